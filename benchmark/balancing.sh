@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Runs wrk against each worker balancing policy and prints the latency
+# distribution for each one. Tail latency is what the policies are meant to
+# improve, so pay attention to the 99th percentile rather than the average.
+#
+# Usage: ./balancing.sh [script] [wrk args...]
+# Defaults to complex.js, with 12 threads and 400 connections for 30s.
+
+set -euo pipefail
+
+cd "$(dirname "$0")"
+
+SCRIPT="${1:-complex.js}"
+shift || true
+WRK_ARGS=("$@")
+if [ ${#WRK_ARGS[@]} -eq 0 ]; then
+    WRK_ARGS=(-t12 -c400 -d30s)
+fi
+
+WINTERJS="${WINTERJS:-../target/release/winterjs}"
+PORT="${PORT:-8080}"
+
+if [ ! -x "$WINTERJS" ]; then
+    echo "winterjs binary not found at $WINTERJS, run cargo build --release first" >&2
+    exit 1
+fi
+
+for policy in least-requests power-of-two-choices least-work round-robin; do
+    "$WINTERJS" serve --port "$PORT" --prewarm --balancing-policy "$policy" "$SCRIPT" >/dev/null 2>&1 &
+    server=$!
+    trap 'kill $server 2>/dev/null || true' EXIT
+
+    # Wait for the server to come up
+    for _ in $(seq 1 100); do
+        if curl -s -o /dev/null "http://127.0.0.1:$PORT"; then
+            break
+        fi
+        sleep 0.1
+    done
+
+    echo "=== $policy ==="
+    # Warm up the JIT before measuring
+    wrk -t2 -c20 -d5s "http://127.0.0.1:$PORT" >/dev/null
+    wrk "${WRK_ARGS[@]}" --latency "http://127.0.0.1:$PORT"
+    echo
+
+    kill -INT $server
+    wait $server || true
+    trap - EXIT
+done
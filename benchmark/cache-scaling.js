@@ -0,0 +1,56 @@
+// Measures Cache API lookups against caches of different sizes. Request
+// /?entries=N to fill a cache with N entries (once per size) and time
+// match, put and delete on it. Used by cache-scaling.sh.
+
+const LOOKUPS = 1000;
+
+const filled = new Map();
+
+async function fill(entries) {
+    if (filled.has(entries)) {
+        return filled.get(entries);
+    }
+
+    const cache = await caches.open(`bench-${entries}`);
+    for (let i = 0; i < entries; i++) {
+        await cache.put(
+            `http://example.com/item/${i}?v=1`,
+            new Response(`item ${i}`, { headers: { vary: 'accept-encoding' } }),
+        );
+    }
+    filled.set(entries, cache);
+    return cache;
+}
+
+async function time(fn) {
+    const start = performance.now();
+    for (let i = 0; i < LOOKUPS; i++) {
+        await fn(i);
+    }
+    return (performance.now() - start) * 1000 / LOOKUPS;
+}
+
+async function handleRequest(request) {
+    const entries = Number(new URL(request.url).searchParams.get('entries') || '1000');
+    const cache = await fill(entries);
+    const key = (i) => `http://example.com/item/${(i * 7919) % entries}?v=1`;
+
+    const result = {
+        entries,
+        match_us: await time((i) => cache.match(key(i))),
+        match_ignore_search_us: await time((i) => cache.match(key(i), { ignoreSearch: true })),
+        miss_us: await time((i) => cache.match(`http://example.com/missing/${i}`)),
+        put_delete_us: await time(async (i) => {
+            await cache.put(`http://example.com/extra/${i}`, new Response('extra'));
+            await cache.delete(`http://example.com/extra/${i}`);
+        }),
+    };
+
+    return new Response(JSON.stringify(result), {
+        headers: { 'content-type': 'application/json' },
+    });
+}
+
+addEventListener('fetch', (event) => {
+    event.respondWith(handleRequest(event.request));
+});
@@ -0,0 +1,44 @@
+#! /bin/bash
+
+# Times Cache API operations against caches of increasing size. With
+# indexed lookups, the time per operation should stay flat as the number
+# of entries grows.
+#
+# Usage: ./cache-scaling.sh [entry counts...]
+# Defaults to 100, 1000, 10000 and 50000 entries.
+
+set -euo pipefail
+
+cd "$(dirname "$0")"
+
+SIZES=("$@")
+if [ ${#SIZES[@]} -eq 0 ]; then
+    SIZES=(100 1000 10000 50000)
+fi
+
+WINTERJS="${WINTERJS:-../target/release/winterjs}"
+PORT="${PORT:-8080}"
+
+if [ ! -x "$WINTERJS" ]; then
+    echo "winterjs binary not found at $WINTERJS, run cargo build --release first" >&2
+    exit 1
+fi
+
+# A single worker, so the timings don't depend on which worker answers
+"$WINTERJS" serve --port "$PORT" --max-js-threads 1 cache-scaling.js >/dev/null 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null || true' EXIT
+
+for _ in $(seq 1 100); do
+    if curl -s -o /dev/null "http://127.0.0.1:$PORT/?entries=1"; then
+        break
+    fi
+    sleep 0.1
+done
+
+for size in "${SIZES[@]}"; do
+    # The first request fills the cache and warms up the JIT
+    curl -s -o /dev/null "http://127.0.0.1:$PORT/?entries=$size"
+    curl -s "http://127.0.0.1:$PORT/?entries=$size"
+    echo
+done
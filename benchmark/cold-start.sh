@@ -0,0 +1,82 @@
+#! /bin/bash
+
+# Measures cold start: the time from launching winterjs until the first
+# request is answered. Each script is started several times, with and
+# without a warm code cache, and the median is printed along with the
+# startup report of the last run.
+#
+# Usage: ./cold-start.sh [runs] [scripts...]
+# Defaults to 10 runs each of simple.js and complex.js.
+
+set -euo pipefail
+
+cd "$(dirname "$0")"
+
+RUNS="${1:-10}"
+shift || true
+SCRIPTS=("$@")
+if [ ${#SCRIPTS[@]} -eq 0 ]; then
+    SCRIPTS=(simple.js complex.js)
+fi
+
+WINTERJS="${WINTERJS:-../target/release/winterjs}"
+PORT="${PORT:-8080}"
+
+if [ ! -x "$WINTERJS" ]; then
+    echo "winterjs binary not found at $WINTERJS, run cargo build --release first" >&2
+    exit 1
+fi
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+now_ms() {
+    date +%s%3N
+}
+
+# Prints the number of milliseconds until the first successful response.
+cold_start() {
+    local script="$1"
+    shift
+
+    local started
+    started=$(now_ms)
+    "$WINTERJS" serve --port "$PORT" --startup-report "$WORK_DIR/report.json" "$@" "$script" >/dev/null 2>&1 &
+    local server=$!
+
+    for _ in $(seq 1 1000); do
+        if curl -sf -o /dev/null "http://127.0.0.1:$PORT"; then
+            break
+        fi
+        sleep 0.005
+    done
+    echo $(($(now_ms) - started))
+
+    kill -INT $server
+    wait $server || true
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+for script in "${SCRIPTS[@]}"; do
+    for mode in no-cache code-cache; do
+        args=()
+        if [ "$mode" = code-cache ]; then
+            args=(--code-cache-dir "$WORK_DIR/code-cache")
+            # Fill the cache first
+            cold_start "$script" "${args[@]}" >/dev/null
+        fi
+
+        times=()
+        for _ in $(seq 1 "$RUNS"); do
+            times+=("$(cold_start "$script" "${args[@]}")")
+        done
+
+        echo "=== $script ($mode) ==="
+        echo "median time to first response: $(printf '%s\n' "${times[@]}" | median) ms"
+        cat "$WORK_DIR/report.json"
+        echo
+    done
+done
@@ -1,6 +1,8 @@
-use std::process::Command;
+use std::{env, path::PathBuf, process::Command};
 
 fn main() {
+    build_transcode_glue();
+
     // We want to let people install WinterJS from source, so we can't have
     // a dependency on TSC at all times. The assumption here is that whoever
     // updates TS sources for builtin modules will at least run WinterJS
@@ -28,3 +30,28 @@ fn main() {
             .success());
     }
 }
+
+// The code cache needs a few C++ wrappers around SpiderMonkey's transcoding
+// API, see src/code_cache/transcode.cpp. They're built against the same
+// headers mozjs_sys compiled SpiderMonkey with.
+fn build_transcode_glue() {
+    const SOURCE: &str = "src/code_cache/transcode.cpp";
+    println!("cargo:rerun-if-changed={SOURCE}");
+
+    let mozjs_dir = PathBuf::from(
+        env::var("DEP_MOZJS_OUTDIR").expect("mozjs_sys did not report its build directory"),
+    );
+
+    // cc picks the compiler, archiver, sysroot and flags for the target, so
+    // this works for cross builds like the WASIX one too.
+    cc::Build::new()
+        .cpp(true)
+        .file(SOURCE)
+        .include(mozjs_dir.join("dist/include"))
+        .flag("-std=c++17")
+        .flag("-fno-exceptions")
+        .flag("-fno-rtti")
+        .flag("-include")
+        .flag(&mozjs_dir.join("js/src/js-confdefs.h").to_string_lossy())
+        .compile("winterjs_transcode");
+}
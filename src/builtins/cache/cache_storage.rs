@@ -1,24 +1,35 @@
-use std::{cell::RefCell, rc::Rc};
+use std::sync::Arc;
 
 use ion::{
     class::Reflector,
     conversions::ToValue,
     function::Opt,
     string::byte::{ByteString, VerbatimBytes},
-    ClassDefinition, Context, Heap, Object, Promise, Result, Value,
+    ClassDefinition, Context, Object, Promise, Result, Value,
 };
 use lazy_static::lazy_static;
 use mozjs_sys::jsapi::JSObject;
+use parking_lot::RwLock;
 use runtime::globals::fetch::RequestInfo;
 
 use crate::{ion_err, ion_mk_err};
 
-use super::{Cache, CacheQueryOptions};
+use super::{store::SharedCache, Cache, CacheQueryOptions};
 
 lazy_static! {
     static ref DEFAULT_CACHE_KEY: ByteString<VerbatimBytes> =
         ByteString::from("_____WINTERJS_DEFAULT_CACHE_____".to_string().into())
             .expect("Should be able to create default cache key");
+
+    // Shared by every worker thread, so a response cached by one worker is
+    // seen by all of them.
+    // Note: The order of the caches is important, so we can't naively use a hashmap here
+    static ref CACHES: RwLock<Vec<(ByteString<VerbatimBytes>, Arc<SharedCache>)>> =
+        RwLock::new(vec![(DEFAULT_CACHE_KEY.clone(), Default::default())]);
+}
+
+fn caches() -> Vec<(ByteString<VerbatimBytes>, Arc<SharedCache>)> {
+    CACHES.read().clone()
 }
 
 #[derive(FromValue)]
@@ -29,16 +40,9 @@ pub struct MultiCacheQueryOptions {
     cache_name: Option<ByteString<VerbatimBytes>>,
 }
 
-// (Request, Response)
-pub(super) type CacheEntryList = Vec<(Heap<*mut JSObject>, Heap<*mut JSObject>)>;
-
 #[js_class]
 pub struct CacheStorage {
     reflector: Reflector,
-
-    // Note: The order of the caches is important, so we can't naively use a hashmap here
-    #[trace(no_trace)]
-    pub(super) caches: Vec<(ByteString<VerbatimBytes>, Rc<RefCell<CacheEntryList>>)>,
 }
 
 #[js_class]
@@ -64,23 +68,18 @@ impl CacheStorage {
                 ignore_vary: o.ignore_vary,
             })
             .unwrap_or_default();
-        for c in &self.caches {
+        for c in &caches() {
             if let Some(cache_name) = cache_name {
                 if &c.0 != cache_name {
                     continue;
                 }
             }
 
-            let responses = match Cache::match_all_impl(
-                c.1.try_borrow().expect("Should be able to borrow entries"),
-                cx,
-                Some(key.clone()),
-                1,
-                &query_options,
-            ) {
-                Ok(r) => r,
-                Err(e) => return Promise::rejected(cx, e),
-            };
+            let responses =
+                match Cache::match_all_impl(&c.1, cx, Some(key.clone()), 1, &query_options) {
+                    Ok(r) => r,
+                    Err(e) => return Promise::rejected(cx, e),
+                };
 
             if !responses.is_empty() {
                 return Promise::resolved(cx, responses[0]);
@@ -91,25 +90,23 @@ impl CacheStorage {
     }
 
     pub fn has(&self, cx: &Context, key: ByteString<VerbatimBytes>) -> Promise {
-        Promise::resolved(cx, self.caches.iter().any(|c| c.0 == key))
+        Promise::resolved(cx, CACHES.read().iter().any(|c| c.0 == key))
     }
 
     pub fn open(&mut self, cx: &Context, key: ByteString<VerbatimBytes>) -> Promise {
-        let index =
-            match self
-                .caches
-                .iter()
-                .enumerate()
-                .find_map(|(i, c)| if c.0 == key { Some(i) } else { None })
-            {
-                Some(i) => i,
+        let entries = {
+            let mut caches = CACHES.write();
+            match caches.iter().find(|c| c.0 == key) {
+                Some(c) => c.1.clone(),
                 None => {
-                    self.caches.push((key, Rc::new(RefCell::new(vec![]))));
-                    self.caches.len() - 1
+                    let entries = Arc::<SharedCache>::default();
+                    caches.push((key, entries.clone()));
+                    entries
                 }
-            };
+            }
+        };
 
-        let cache = Cache::new_object(cx, Box::new(Cache::new(self.caches[index].1.clone())));
+        let cache = Cache::new_object(cx, Box::new(Cache::new(entries)));
         Promise::resolved(cx, cache)
     }
 
@@ -118,29 +115,31 @@ impl CacheStorage {
             return Promise::rejected(cx, ion_mk_err!("Cannot delete the default cache", Type));
         }
 
-        let index = self
-            .caches
-            .iter()
-            .enumerate()
-            .find(|c| c.1 .0 == key)
-            .map(|c| c.0);
-        if let Some(index) = index {
-            self.caches.remove(index);
-            Promise::resolved(cx, true)
-        } else {
-            Promise::resolved(cx, false)
-        }
+        let removed = {
+            let mut caches = CACHES.write();
+            let index = caches.iter().position(|c| c.0 == key);
+            index.map(|index| caches.remove(index)).is_some()
+        };
+        Promise::resolved(cx, removed)
     }
 
     pub fn keys(&self, cx: &Context) -> Promise {
-        let result = self.caches.iter().map(|c| c.0.clone()).collect::<Vec<_>>();
+        let result = CACHES
+            .read()
+            .iter()
+            .map(|c| c.0.clone())
+            .collect::<Vec<_>>();
         Promise::resolved(cx, result)
     }
 
     #[ion(get)]
     pub fn get_default(&self, cx: &Context) -> *mut JSObject {
-        assert!(!self.caches.is_empty() && self.caches[0].0 == *DEFAULT_CACHE_KEY);
-        Cache::new_object(cx, Box::new(Cache::new(self.caches[0].1.clone())))
+        let entries = {
+            let caches = CACHES.read();
+            assert!(!caches.is_empty() && caches[0].0 == *DEFAULT_CACHE_KEY);
+            caches[0].1.clone()
+        };
+        Cache::new_object(cx, Box::new(Cache::new(entries)))
     }
 }
 
@@ -149,15 +148,10 @@ pub fn define(cx: &Context, global: &Object) -> bool {
         return false;
     }
 
-    let mut caches = CacheStorage {
+    let caches = CacheStorage {
         reflector: Default::default(),
-        caches: Default::default(),
     };
 
-    caches
-        .caches
-        .push((DEFAULT_CACHE_KEY.clone(), Rc::new(RefCell::new(vec![]))));
-
     let caches_obj = CacheStorage::new_object(cx, Box::new(caches));
     global.set(
         cx,
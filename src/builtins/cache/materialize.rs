@@ -0,0 +1,111 @@
+//! Creates JS objects for cache records on the thread that asked for them.
+
+use std::{cell::RefCell, collections::HashMap};
+
+use ion::{
+    conversions::ToValue, function::Opt, ClassDefinition, Context, Function, Object, PermanentHeap,
+    Result,
+};
+use mozjs_sys::jsapi::{JSFunction, JSObject};
+use runtime::globals::fetch::{FetchBody, FetchBodyInner, Request, RequestInfo, Response};
+
+use crate::{ion_mk_err, sm_utils};
+
+use super::store::{CacheRecord, ResponseKind};
+
+const TEMPLATE_SCRIPT: &str = include_str!("response_template.js");
+
+thread_local! {
+    static MAKE_TEMPLATE: RefCell<Option<PermanentHeap<*mut JSFunction>>> = RefCell::new(None);
+
+    // Empty responses with a given status and status text, with a status of
+    // 0 standing for `Response.error()`. There are only ever a few of these,
+    // and cloning one is cheaper than calling into JS for every hit.
+    static TEMPLATES: RefCell<HashMap<(u16, String), PermanentHeap<*mut JSObject>>> =
+        RefCell::new(HashMap::new());
+}
+
+pub fn response(cx: &Context, record: &CacheRecord) -> Result<*mut JSObject> {
+    // The body is shared with the record, not copied.
+    let mut response = match &record.kind {
+        ResponseKind::Fetched { url } => {
+            let mut response = hyper::Response::new(hyper::Body::from(record.body.clone()));
+            *response.status_mut() = http::StatusCode::from_u16(record.status)
+                .map_err(|_| ion_mk_err!("The cached response has an invalid status", Normal))?;
+            Response::from_hyper_response(cx, response, url.clone())?
+        }
+        ResponseKind::Constructed { status_text } => {
+            let template = template(cx, record.status, status_text)?;
+            Response::get_private(cx, &template)
+                .unwrap()
+                .clone_with_body(Some(FetchBody {
+                    body: FetchBodyInner::Bytes(record.body.clone()),
+                    ..Default::default()
+                }))
+        }
+        // Error responses have a null body.
+        ResponseKind::Error => {
+            let template = template(cx, 0, "")?;
+            Response::get_private(cx, &template)
+                .unwrap()
+                .clone_with_body(None)
+        }
+    };
+    *response.headers_mut(cx) = record.headers.clone();
+    Ok(Response::new_object(cx, Box::new(response)))
+}
+
+pub fn request(cx: &Context, record: &CacheRecord) -> Result<*mut JSObject> {
+    let mut request =
+        Request::constructor(cx, RequestInfo::String(record.url.to_string()), Opt(None))?;
+    *request.headers_mut(cx) = record.request_headers.clone();
+    Ok(Request::new_object(cx, Box::new(request)))
+}
+
+fn template<'cx>(cx: &'cx Context, status: u16, status_text: &str) -> Result<Object<'cx>> {
+    let key = (status, status_text.to_owned());
+    if let Some(template) = TEMPLATES.with(|t| t.borrow().get(&key).map(|t| t.get())) {
+        return Ok(cx.root(template).into());
+    }
+
+    if MAKE_TEMPLATE.with(|m| m.borrow().is_none()) {
+        let f = load_make_template(cx)?;
+        MAKE_TEMPLATE.with(|m| *m.borrow_mut() = Some(PermanentHeap::from_local(&f)));
+    }
+    let make_template = MAKE_TEMPLATE.with(|m| m.borrow().as_ref().unwrap().get());
+
+    let template = Function::from(cx.root(make_template))
+        .call(
+            cx,
+            &Object::null(cx),
+            &[status.as_value(cx), status_text.as_value(cx)],
+        )
+        .map_err(|e| ion_mk_err!(&format!("Failed to create cached response: {e:?}"), Normal))?;
+    if !template.handle().is_object() {
+        return Err(ion_mk_err!("Failed to create cached response", Normal));
+    }
+    let template = template.to_object(cx);
+
+    TEMPLATES.with(|t| {
+        t.borrow_mut()
+            .insert(key, PermanentHeap::from_local(&template))
+    });
+    Ok(template)
+}
+
+fn load_make_template(cx: &Context) -> Result<Function> {
+    let error = |e: String| {
+        ion_mk_err!(
+            &format!("Failed to load cache response template: {e}"),
+            Normal
+        )
+    };
+
+    let f = sm_utils::evaluate_script(cx, TEMPLATE_SCRIPT, "response_template.js")
+        .map_err(|e| error(e.to_string()))?;
+    f.handle()
+        .is_object()
+        .then(|| Function::from_object(cx, &f.to_object(cx)))
+        .flatten()
+        .ok_or_else(|| error("not a function".to_owned()))
+}
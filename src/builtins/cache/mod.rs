@@ -1,30 +1,29 @@
-use std::{
-    cell::RefCell,
-    ops::{Deref, DerefMut},
-    rc::Rc,
-};
+use std::sync::Arc;
 
 use futures::future::Either;
 use http::{header, Method};
 use ion::{
     class::{NativeObject, Reflector},
     function::Opt,
-    ClassDefinition, Context, Heap, Object, Promise, Result, TracedHeap,
+    ClassDefinition, Context, Object, Promise, Result, TracedHeap,
 };
 use mozjs_sys::{
     jsapi::JSObject,
     jsval::{ObjectValue, UndefinedValue},
 };
 use runtime::{
-    globals::fetch::{FetchBody, FetchBodyInner, Request, RequestInfo, Response},
+    globals::fetch::{FetchBodyInner, Request, RequestInfo, Response},
     promise::future_to_promise,
 };
+use url::Url;
 
-use crate::ion_err;
+use crate::{ion_err, ion_mk_err};
 
-use self::cache_storage::CacheEntryList;
+use self::store::{CacheRecord, ResponseKind, SharedCache};
 
 mod cache_storage;
+mod materialize;
+mod store;
 
 #[derive(FromValue, Default)]
 pub struct CacheQueryOptions {
@@ -38,31 +37,31 @@ pub struct Cache {
     reflector: Reflector,
 
     #[trace(no_trace)]
-    entries: Rc<RefCell<CacheEntryList>>,
+    entries: Arc<SharedCache>,
 }
 
 impl Cache {
-    pub fn new(entries: Rc<RefCell<CacheEntryList>>) -> Self {
+    pub fn new(entries: Arc<SharedCache>) -> Self {
         Self {
             reflector: Default::default(),
             entries,
         }
     }
 
-    pub fn entries(&self) -> impl Deref<Target = CacheEntryList> + '_ {
-        self.entries
-            .try_borrow()
-            .expect("Should be able to borrow entries")
-    }
-
-    pub fn entries_mut(&mut self) -> impl DerefMut<Target = CacheEntryList> + '_ {
-        self.entries
-            .try_borrow_mut()
-            .expect("Should be able to borrow entries mutably")
+    fn find(
+        entries: &SharedCache,
+        cx: &Context,
+        request: &Request,
+        options: &CacheQueryOptions,
+    ) -> Vec<Arc<CacheRecord>> {
+        if request.method() != Method::GET && options.ignore_method != Some(true) {
+            return vec![];
+        }
+        entries.find(request.url(), request.headers(cx), options)
     }
 
     pub fn match_all_impl(
-        entries: impl Deref<Target = CacheEntryList>,
+        entries: &SharedCache,
         cx: &Context,
         key: Option<RequestInfo>,
         max_entries: usize,
@@ -76,84 +75,15 @@ impl Cache {
             .map(|key| Self::request_info_to_request(cx, key))
             .transpose()?;
 
-        let mut responses = vec![];
-
-        for (req, resp) in &*entries {
-            let response = Response::get_mut_private(cx, &resp.root(cx).into()).unwrap();
-            if Self::is_match(
-                cx,
-                request,
-                Request::get_private(cx, &req.root(cx).into()).unwrap(),
-                response,
-                options,
-            ) {
-                responses.push(Response::new_object(cx, Box::new(response.try_clone(cx)?)));
-            }
-
-            if responses.len() >= max_entries {
-                return Ok(responses);
-            }
-        }
-
-        Ok(responses)
-    }
-
-    fn is_match(
-        cx: &Context,
-        to_match: Option<&Request>,
-        key: &Request,
-        value: &Response,
-        options: &CacheQueryOptions,
-    ) -> bool {
-        let Some(request) = to_match else {
-            return true;
-        };
-
-        if request.method() != Method::GET && options.ignore_method != Some(true) {
-            return false;
-        }
-
-        let mut query_url = request.url().clone();
-        let mut cached_url = key.url().clone();
-
-        query_url.set_fragment(None);
-        cached_url.set_fragment(None);
-
-        if options.ignore_search == Some(true) {
-            query_url.set_query(None);
-            cached_url.set_query(None);
-        }
-
-        if query_url != cached_url {
-            return false;
-        }
-
-        if options.ignore_vary == Some(true) || value.get_type().as_str() == "opaque" {
-            return true;
-        }
-
-        let Some(vary) = value.headers(cx).get(header::VARY) else {
-            return true;
-        };
-
-        let Ok(vary_header) = vary.to_str() else {
-            return false;
+        let records = match request {
+            Some(request) => Self::find(entries, cx, request, options),
+            None => entries.all(),
         };
-        let header_names = vary_header.split(',');
-
-        let query_headers = request.headers(cx);
-        let cached_headers = key.headers(cx);
-
-        for header_name in header_names {
-            let header_name = header_name.trim();
-            let query_value = query_headers.get(header_name);
-            let cached_value = cached_headers.get(header_name);
-            if query_value != cached_value {
-                return false;
-            }
-        }
-
-        true
+        records
+            .iter()
+            .take(max_entries)
+            .map(|record| materialize::response(cx, record))
+            .collect()
     }
 
     fn request_info_to_request<'cx>(
@@ -176,7 +106,7 @@ impl Cache {
     }
 
     pub async fn put_impl(
-        this: TracedHeap<*mut JSObject>,
+        entries: Arc<SharedCache>,
         mut cx: Context,
         request: TracedHeap<*mut JSObject>,
         response: TracedHeap<*mut JSObject>,
@@ -200,21 +130,41 @@ impl Cache {
             );
         }
 
-        if response_ref.get_type().as_str() != "opaque" {
-            if let Some(vary) = response_ref.headers(&cx).get(header::VARY) {
-                let Ok(vary_header) = vary.to_str() else {
-                    ion_err!(
-                        "The response has an invalid value for the Vary header",
-                        Type
-                    );
-                };
-                let mut values = vary_header.split(',');
-                if values.any(|v| v.trim() == "*") {
-                    ion_err!(
-                        "The response has the 'Vary: *' header, which cannot be cached",
-                        Type
-                    );
-                }
+        // Entries are recreated as native responses, which the runtime can
+        // only do for these types. Anything else would come back with the
+        // wrong type, so it isn't stored at all.
+        let kind = match response_ref.get_type().as_str() {
+            "default" => ResponseKind::Constructed {
+                status_text: response_ref.get_status_text(),
+            },
+            "error" => ResponseKind::Error,
+            "basic" if !response_ref.get_redirected() => ResponseKind::Fetched {
+                url: Url::parse(&response_ref.get_url())
+                    .map_err(|_| ion_mk_err!("The response has an invalid URL", Type))?,
+            },
+            "basic" => ion_err!("Redirected responses cannot be cached", Type),
+            _ => ion_err!(
+                &format!(
+                    "Responses of type '{}' cannot be cached",
+                    response_ref.get_type()
+                ),
+                Type
+            ),
+        };
+
+        if let Some(vary) = response_ref.headers(&cx).get(header::VARY) {
+            let Ok(vary_header) = vary.to_str() else {
+                ion_err!(
+                    "The response has an invalid value for the Vary header",
+                    Type
+                );
+            };
+            let mut values = vary_header.split(',');
+            if values.any(|v| v.trim() == "*") {
+                ion_err!(
+                    "The response has the 'Vary: *' header, which cannot be cached",
+                    Type
+                );
             }
         }
 
@@ -233,47 +183,31 @@ impl Cache {
         let body_bytes = body_bytes?.unwrap_or_default();
 
         let response_ref = Response::get_private(&cx, &response.root(&cx).into()).unwrap();
-
-        let this_ref = Self::get_mut_private(&cx, &this.root(&cx).into()).unwrap();
         let request_ref = Request::get_private(&cx, &request.root(&cx).into()).unwrap();
-        Self::delete_impl(this_ref.entries_mut(), &cx, request_ref, Opt(None));
-
-        let cached_response = Heap::new(Response::new_object(
-            &cx,
-            Box::new(response_ref.clone_with_body(Some(FetchBody {
-                body: FetchBodyInner::Bytes(body_bytes),
-                ..Default::default()
-            }))),
-        ));
 
-        this_ref
-            .entries_mut()
-            .push((Heap::new(request.get()), cached_response));
+        entries.put(CacheRecord::new(
+            request_ref.url(),
+            request_ref.headers(&cx).clone(),
+            response_ref.get_status(),
+            response_ref.headers(&cx).clone(),
+            body_bytes,
+            kind,
+        ));
 
         Ok(())
     }
 
     pub fn delete_impl(
-        mut entries: impl DerefMut<Target = CacheEntryList>,
+        entries: &SharedCache,
         cx: &Context,
         key: &Request,
         Opt(options): Opt<CacheQueryOptions>,
     ) -> bool {
-        let mut result = false;
         let options = options.unwrap_or_default();
-        for i in (0..entries.len()).rev() {
-            if Self::is_match(
-                cx,
-                Some(key),
-                Request::get_private(cx, &entries[i].0.root(cx).into()).unwrap(),
-                Response::get_private(cx, &entries[i].1.root(cx).into()).unwrap(),
-                &options,
-            ) {
-                entries.remove(i);
-                result = true;
-            }
+        if key.method() != Method::GET && options.ignore_method != Some(true) {
+            return false;
         }
-        result
+        entries.delete(key.url(), key.headers(cx), &options)
     }
 }
 
@@ -294,7 +228,7 @@ impl Cache {
         Promise::from_result(
             cx,
             Self::match_all_impl(
-                self.entries(),
+                &self.entries,
                 cx,
                 Some(key),
                 1,
@@ -319,7 +253,7 @@ impl Cache {
         Promise::from_result(
             cx,
             Self::match_all_impl(
-                self.entries(),
+                &self.entries,
                 cx,
                 key,
                 usize::MAX,
@@ -334,7 +268,7 @@ impl Cache {
 
     // TODO: run the requests in parallel
     pub fn add_all(&self, cx: &Context, requests: Vec<RequestInfo>) -> Option<Promise> {
-        let this = TracedHeap::new(self.reflector().get());
+        let entries = self.entries.clone();
         let requests = requests
             .into_iter()
             .map(|r| match r {
@@ -383,12 +317,12 @@ impl Cache {
                             Request::get_private(&cx, &prev_req.to_local().into()).unwrap();
                         let prev_resp =
                             Response::get_private(&cx, &prev_resp.to_local().into()).unwrap();
-                        if Cache::is_match(
-                            &cx,
-                            Some(req),
-                            prev_req,
-                            prev_resp,
-                            &CacheQueryOptions::default(),
+                        if store::request_matches(
+                            req.url(),
+                            req.headers(&cx),
+                            prev_req.url(),
+                            prev_req.headers(&cx),
+                            prev_resp.headers(&cx),
                         ) {
                             ion_err!("Cannot cache matching requests with addAll", Normal);
                         }
@@ -443,9 +377,9 @@ impl Cache {
 
                 for (req, resp) in to_commit {
                     let result;
-                    let this_clone = this.clone();
+                    let entries = entries.clone();
                     (cx, result) = cx
-                        .await_native_cx(|cx| Self::put_impl(this_clone, cx, req, resp))
+                        .await_native_cx(|cx| Self::put_impl(entries, cx, req, resp))
                         .await;
                     result?;
                 }
@@ -461,14 +395,14 @@ impl Cache {
         request: RequestInfo,
         response: &Response,
     ) -> Option<Promise> {
-        let this = TracedHeap::new(self.reflector().get());
+        let entries = self.entries.clone();
         let request = match Self::request_info_to_request(cx, request) {
             Ok(x) => x,
             Err(e) => return Some(Promise::rejected(cx, e)),
         };
         let request = TracedHeap::new(request.reflector().get());
         let response = TracedHeap::new(response.reflector().get());
-        unsafe { future_to_promise(cx, |cx| Self::put_impl(this, cx, request, response)) }
+        unsafe { future_to_promise(cx, |cx| Self::put_impl(entries, cx, request, response)) }
     }
 
     pub fn delete(
@@ -481,10 +415,7 @@ impl Cache {
             Ok(x) => x,
             Err(e) => return Promise::rejected(cx, e),
         };
-        Promise::resolved(
-            cx,
-            Self::delete_impl(self.entries_mut(), cx, request, options),
-        )
+        Promise::resolved(cx, Self::delete_impl(&self.entries, cx, request, options))
     }
 
     pub fn keys(
@@ -493,44 +424,21 @@ impl Cache {
         Opt(request): Opt<RequestInfo>,
         Opt(options): Opt<CacheQueryOptions>,
     ) -> Promise {
-        match request {
-            None => Promise::from_result(
-                cx,
-                self.entries()
-                    .iter()
-                    .map(|r| {
-                        let req = Request::get_mut_private(cx, &r.0.root(cx).into()).unwrap();
-                        Result::Ok(Request::new_object(cx, Box::new(req.try_clone(cx)?)))
-                    })
-                    .collect::<Result<Vec<_>>>(),
-            ),
-            Some(request) => {
-                let request = match Self::request_info_to_request(cx, request) {
-                    Ok(x) => x,
-                    Err(e) => return Promise::rejected(cx, e),
-                };
-
-                let mut result = vec![];
-                let options = options.unwrap_or_default();
-
-                for entry in &*self.entries() {
-                    let cached_req =
-                        Request::get_mut_private(cx, &entry.0.root(cx).into()).unwrap();
-                    let cached_resp = Response::get_private(cx, &entry.1.root(cx).into()).unwrap();
-                    if Self::is_match(cx, Some(request), cached_req, cached_resp, &options) {
-                        match cached_req.try_clone(cx) {
-                            Err(e) => return Promise::rejected(cx, e),
-                            Ok(r) => {
-                                let req_obj = Request::new_object(cx, Box::new(r));
-                                result.push(req_obj);
-                            }
-                        }
-                    }
-                }
+        let records = match request {
+            None => self.entries.all(),
+            Some(request) => match Self::request_info_to_request(cx, request) {
+                Ok(request) => Self::find(&self.entries, cx, request, &options.unwrap_or_default()),
+                Err(e) => return Promise::rejected(cx, e),
+            },
+        };
 
-                Promise::resolved(cx, result)
-            }
-        }
+        Promise::from_result(
+            cx,
+            records
+                .iter()
+                .map(|record| materialize::request(cx, record))
+                .collect::<Result<Vec<_>>>(),
+        )
     }
 }
 
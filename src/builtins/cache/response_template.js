@@ -0,0 +1,11 @@
+// Creates the responses that cache hits for constructed and error
+// responses are cloned from, so they keep the type, URL and status text a
+// Response created by a script has. A status of 0 stands for an error
+// response, which no other response can have.
+
+(function (status, statusText) {
+  if (status === 0) {
+    return Response.error();
+  }
+  return new Response(null, { status, statusText });
+});
@@ -0,0 +1,278 @@
+//! The storage behind the Cache API. Caches are shared by every worker
+//! thread in the process, so they can't hold on to JS objects: entries are
+//! stored as immutable records of the request's URL and headers and the
+//! response's status, headers and body, and JS objects are created from
+//! them when a script asks for an entry.
+
+use std::{
+    collections::{hash_map::DefaultHasher, HashMap},
+    hash::{Hash, Hasher},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+};
+
+use bytes::Bytes;
+use http::{header, HeaderMap, HeaderName, HeaderValue};
+use parking_lot::RwLock;
+use url::{Position, Url};
+
+use super::CacheQueryOptions;
+
+const SHARDS: usize = 16;
+
+pub struct CacheRecord {
+    /// The request URL, without its fragment.
+    pub url: Url,
+    pub request_headers: HeaderMap,
+    // Not a `StatusCode`, since error responses have a status of 0.
+    pub status: u16,
+    pub headers: HeaderMap,
+    pub body: Bytes,
+    pub kind: ResponseKind,
+    vary: VarySignature,
+    // Insertion order across all shards.
+    seq: u64,
+}
+
+impl CacheRecord {
+    pub fn new(
+        url: &Url,
+        request_headers: HeaderMap,
+        status: u16,
+        headers: HeaderMap,
+        body: Bytes,
+        kind: ResponseKind,
+    ) -> Self {
+        let mut url = url.clone();
+        url.set_fragment(None);
+
+        let vary = VarySignature::new(&headers, &request_headers);
+
+        Self {
+            url,
+            request_headers,
+            status,
+            headers,
+            body,
+            kind,
+            vary,
+            seq: 0,
+        }
+    }
+}
+
+/// Where the cached response came from, which decides how it's recreated.
+/// Every kind is recreated as a native response of the same type.
+pub enum ResponseKind {
+    /// Created by a script, with `new Response()`.
+    Constructed { status_text: String },
+    /// Created by `Response.error()`.
+    Error,
+    /// A basic response returned by `fetch`.
+    Fetched { url: Url },
+}
+
+// The values the cached request had for the headers named by the
+// response's `Vary` header, captured when the entry is stored.
+enum VarySignature {
+    Any,
+    Headers(Vec<(HeaderName, Option<HeaderValue>)>),
+    // The Vary header couldn't be parsed, so only `ignoreVary` matches.
+    Invalid,
+}
+
+impl VarySignature {
+    fn new(response_headers: &HeaderMap, request_headers: &HeaderMap) -> Self {
+        let Some(vary) = response_headers.get(header::VARY) else {
+            return Self::Any;
+        };
+        let Ok(vary) = vary.to_str() else {
+            return Self::Invalid;
+        };
+
+        let headers = vary
+            .split(',')
+            // Names that aren't valid never match a header on either side.
+            .filter_map(|name| HeaderName::from_bytes(name.trim().as_bytes()).ok())
+            .map(|name| {
+                let value = request_headers.get(&name).cloned();
+                (name, value)
+            })
+            .collect();
+        Self::Headers(headers)
+    }
+
+    fn matches(&self, headers: &HeaderMap) -> bool {
+        match self {
+            Self::Any => true,
+            Self::Headers(values) => values
+                .iter()
+                .all(|(name, value)| headers.get(name) == value.as_ref()),
+            Self::Invalid => false,
+        }
+    }
+}
+
+// Fragments are never part of a cache key.
+fn url_keys(url: &Url) -> (&str, &str) {
+    (&url[..Position::AfterQuery], &url[..Position::AfterPath])
+}
+
+/// Whether a request for `url` with `headers` would match an entry stored
+/// for `cached_url` and `cached_headers` with `response_headers`, using the
+/// default query options. Lets requests be checked against each other
+/// before their entries are stored.
+pub fn request_matches(
+    url: &Url,
+    headers: &HeaderMap,
+    cached_url: &Url,
+    cached_headers: &HeaderMap,
+    response_headers: &HeaderMap,
+) -> bool {
+    url_keys(url).0 == url_keys(cached_url).0
+        && VarySignature::new(response_headers, cached_headers).matches(headers)
+}
+
+/// A single named cache.
+pub struct SharedCache {
+    // Sharded by the URL without its search part, so lookups with and
+    // without `ignoreSearch` only ever need one shard.
+    shards: Box<[RwLock<Shard>]>,
+    next_seq: AtomicU64,
+}
+
+// Both maps hold the records in insertion order.
+#[derive(Default)]
+struct Shard {
+    by_url: HashMap<String, Vec<Arc<CacheRecord>>>,
+    by_url_without_search: HashMap<String, Vec<Arc<CacheRecord>>>,
+}
+
+impl Default for SharedCache {
+    fn default() -> Self {
+        Self {
+            shards: (0..SHARDS).map(|_| Default::default()).collect(),
+            next_seq: AtomicU64::new(0),
+        }
+    }
+}
+
+impl SharedCache {
+    fn shard(&self, url_without_search: &str) -> &RwLock<Shard> {
+        let mut hasher = DefaultHasher::new();
+        url_without_search.hash(&mut hasher);
+        &self.shards[hasher.finish() as usize % SHARDS]
+    }
+
+    /// Returns the records matching a request for `url` with `headers`, in
+    /// insertion order. The request's method is up to the caller to check.
+    pub fn find(
+        &self,
+        url: &Url,
+        headers: &HeaderMap,
+        options: &CacheQueryOptions,
+    ) -> Vec<Arc<CacheRecord>> {
+        let (_, url_without_search) = url_keys(url);
+        self.shard(url_without_search)
+            .read()
+            .find(url, headers, options)
+    }
+
+    /// Returns every record, in insertion order.
+    pub fn all(&self) -> Vec<Arc<CacheRecord>> {
+        let mut records = vec![];
+        for shard in self.shards.iter() {
+            records.extend(shard.read().by_url.values().flatten().cloned());
+        }
+        records.sort_unstable_by_key(|r| r.seq);
+        records
+    }
+
+    /// Stores `record`, replacing the records a request for it would match.
+    pub fn put(&self, record: CacheRecord) {
+        let (_, url_without_search) = url_keys(&record.url);
+        let mut shard = self.shard(url_without_search).write();
+
+        for old in shard.find(&record.url, &record.request_headers, &Default::default()) {
+            shard.remove(&old);
+        }
+
+        let mut record = record;
+        record.seq = self.next_seq.fetch_add(1, Ordering::Relaxed);
+        shard.insert(Arc::new(record));
+    }
+
+    /// Removes the records matching a request for `url` with `headers`.
+    /// Returns whether there were any.
+    pub fn delete(&self, url: &Url, headers: &HeaderMap, options: &CacheQueryOptions) -> bool {
+        let (_, url_without_search) = url_keys(url);
+        let mut shard = self.shard(url_without_search).write();
+
+        let matches = shard.find(url, headers, options);
+        for record in &matches {
+            shard.remove(record);
+        }
+        !matches.is_empty()
+    }
+}
+
+impl Shard {
+    fn find(
+        &self,
+        url: &Url,
+        headers: &HeaderMap,
+        options: &CacheQueryOptions,
+    ) -> Vec<Arc<CacheRecord>> {
+        let (url, url_without_search) = url_keys(url);
+        let candidates = if options.ignore_search == Some(true) {
+            self.by_url_without_search.get(url_without_search)
+        } else {
+            self.by_url.get(url)
+        };
+        let Some(candidates) = candidates else {
+            return vec![];
+        };
+
+        if options.ignore_vary == Some(true) {
+            return candidates.clone();
+        }
+        candidates
+            .iter()
+            .filter(|r| r.vary.matches(headers))
+            .cloned()
+            .collect()
+    }
+
+    fn insert(&mut self, record: Arc<CacheRecord>) {
+        let (url, url_without_search) = url_keys(&record.url);
+        self.by_url
+            .entry(url.to_owned())
+            .or_default()
+            .push(record.clone());
+        self.by_url_without_search
+            .entry(url_without_search.to_owned())
+            .or_default()
+            .push(record);
+    }
+
+    fn remove(&mut self, record: &Arc<CacheRecord>) {
+        let (url, url_without_search) = url_keys(&record.url);
+        remove_from_index(&mut self.by_url, url, record);
+        remove_from_index(&mut self.by_url_without_search, url_without_search, record);
+    }
+}
+
+fn remove_from_index(
+    index: &mut HashMap<String, Vec<Arc<CacheRecord>>>,
+    key: &str,
+    record: &Arc<CacheRecord>,
+) {
+    if let Some(records) = index.get_mut(key) {
+        records.retain(|r| !Arc::ptr_eq(r, record));
+        if records.is_empty() {
+            index.remove(key);
+        }
+    }
+}
@@ -1,4 +1,4 @@
-//! Here, we initialize those modules that are defined in JS, as
+//! Here, we provide those modules that are defined in JS, as
 //! opposed to native modules defined in Rust. The sources for
 //! these modules should be put under the internal_js_modules dir
 //! that lives next to this source file.
@@ -8,71 +8,113 @@
 //! extension will be stripped. So, to create a node:buffer module,
 //! one must put the source under `internal_js_modules/node/buffer.js`.
 //!
+//! Modules are compiled and registered the first time they are imported,
+//! so apps only pay for the ones they use.
+//!
 //! Note: Files that don't have a .js extension will be ignored.
 
-use anyhow::{anyhow, Context as _};
-use clap::builder::OsStr;
+use std::collections::HashSet;
+
 use include_dir::{include_dir, Dir, File};
 use ion::{
-    module::{Module, ModuleRequest},
-    Context,
+    module::{ModuleLoader, ModuleRequest},
+    Context, Object, Value,
 };
+use mozjs::jsapi::JSObject;
 
-const MODULES_DIR: Dir = include_dir!("src/builtins/internal_js_modules");
-
-pub(super) fn define(cx: &Context) -> bool {
-    match scan_dir(cx, &MODULES_DIR) {
-        Ok(()) => true,
-        Err(e) => {
-            tracing::error!(
-                error = %e,
-                "Failed to load internal modules"
-            );
-            false
-        }
-    }
+use crate::{
+    sm_utils,
+    startup::{self, Phase},
+};
+
+static MODULES_DIR: Dir<'static> = include_dir!("src/builtins/internal_js_modules");
+
+// Only these prefixes are looked up in MODULES_DIR, everything else goes
+// straight to the wrapped loader.
+const PREFIXES: &[&str] = &["node:", "__winterjs_internal:"];
+
+/// Wraps a module loader, and registers internal modules with it when
+/// they are first requested.
+pub struct Loader<L: ModuleLoader> {
+    inner: L,
+    registered: HashSet<String>,
 }
 
-fn scan_dir(cx: &Context, dir: &Dir) -> anyhow::Result<()> {
-    for file in dir.files() {
-        if file.path().extension() == Some(&OsStr::from("js")) {
-            compile_and_register(cx, file)?;
+impl<L: ModuleLoader> Loader<L> {
+    pub fn new(inner: L) -> Self {
+        Self {
+            inner,
+            registered: HashSet::new(),
         }
     }
 
-    for dir in dir.dirs() {
-        scan_dir(cx, dir)?;
+    fn register_internal_module(
+        &mut self,
+        cx: &Context,
+        module_name: &str,
+        script_file: &File,
+    ) -> ion::Result<()> {
+        tracing::debug!("Registering internal module at {:?}", script_file.path());
+
+        let contents = script_file.contents_utf8().ok_or_else(|| {
+            ion::Error::new(
+                "Failed to convert internal module contents to UTF-8",
+                ion::ErrorKind::Normal,
+            )
+        })?;
+
+        let module = startup::measure(Phase::InternalModules, || {
+            sm_utils::compile_module(cx, module_name, None, contents)
+        })
+        .map_err(|e| {
+            ion::Error::new(
+                &format!("Failed to compile internal module {module_name}: {e:?}"),
+                ion::ErrorKind::Normal,
+            )
+        })?;
+
+        let request = ModuleRequest::new(cx, module_name);
+        self.inner.register(cx, module.module_object(), &request)?;
+        Ok(())
     }
+}
 
-    Ok(())
+fn find_internal_module(specifier: &str) -> Option<&'static File<'static>> {
+    if !PREFIXES.iter().any(|p| specifier.starts_with(p)) {
+        return None;
+    }
+
+    MODULES_DIR.get_file(format!("{}.js", specifier.replace(':', "/")))
 }
 
-fn compile_and_register(cx: &Context, script_file: &File) -> anyhow::Result<()> {
-    tracing::debug!("Registering internal module at {:?}", script_file.path());
-
-    let module_name = script_file
-        .path()
-        .to_str()
-        .context("Failed to convert module path to string")?
-        .strip_suffix(".js")
-        .context("Script file path must have a .js suffix")?
-        .replace('/', ":");
-
-    let contents = script_file
-        .contents_utf8()
-        .context("Failed to convert file contents to UTF-8")?;
-
-    let module = Module::compile(cx, &module_name, None, contents)
-        .map_err(|e| anyhow::anyhow!("Module compilation failed: {e:?}"))?;
-
-    match unsafe { &mut (*cx.get_inner_data().as_ptr()).module_loader } {
-        Some(loader) => {
-            let request = ModuleRequest::new(cx, module_name);
-            loader
-                .register(cx, module.module_object(), &request)
-                .map_err(|e| anyhow!("Failed to register internal module due to: {e}"))?;
-            Ok(())
+impl<L: ModuleLoader> ModuleLoader for Loader<L> {
+    fn resolve(
+        &mut self,
+        cx: &Context,
+        private: &Value,
+        request: &ModuleRequest,
+    ) -> ion::Result<*mut JSObject> {
+        let specifier = request.specifier(cx).to_owned(cx)?;
+        if !self.registered.contains(&specifier) {
+            if let Some(file) = find_internal_module(&specifier) {
+                self.register_internal_module(cx, &specifier, file)?;
+                self.registered.insert(specifier);
+            }
         }
-        None => anyhow::bail!("No module loader present, cannot register internal module"),
+
+        self.inner.resolve(cx, private, request)
+    }
+
+    fn register(
+        &mut self,
+        cx: &Context,
+        module: *mut JSObject,
+        request: &ModuleRequest,
+    ) -> ion::Result<*mut JSObject> {
+        self.inner.register(cx, module, request)
+    }
+
+    fn metadata(&self, cx: &Context, private: &Value, meta: &mut Object) -> ion::Result<()> {
+        self.inner.metadata(cx, private, meta)
     }
 }
@@ -4,10 +4,12 @@
 //!
 //! Note: Files that don't have a .js extension will be ignored.
 
-use anyhow::{bail, Context as _};
+use anyhow::Context as _;
 use clap::builder::OsStr;
 use include_dir::{include_dir, Dir, File};
-use ion::{script::Script, Context};
+use ion::Context;
+
+use crate::sm_utils;
 
 const MODULES_DIR: Dir = include_dir!("src/builtins/js_globals");
 
@@ -45,19 +47,13 @@ fn compile_and_evaluate(cx: &Context, script_file: &File) -> anyhow::Result<()>
         .contents_utf8()
         .context("Failed to convert file contents to UTF-8")?;
 
-    let script = Script::compile(cx, script_file.path(), contents)
-        .map_err(|e| anyhow::anyhow!("Script compilation failed: {e:?}"))?;
-
-    match script.evaluate(cx) {
-        Ok(val) => {
-            if !val.get().is_undefined() {
-                tracing::warn!(
-                    "js_globals script {} returned a result, ignoring",
-                    script_file.path().to_string_lossy()
-                );
-            }
-            Ok(())
-        }
-        Err(e) => bail!("Script execution failed: {e:?}"),
+    let val = sm_utils::evaluate_script(cx, contents, script_file.path())
+        .context("Script execution failed")?;
+    if !val.get().is_undefined() {
+        tracing::warn!(
+            "js_globals script {} returned a result, ignoring",
+            script_file.path().to_string_lossy()
+        );
     }
+    Ok(())
 }
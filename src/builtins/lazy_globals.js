@@ -0,0 +1,43 @@
+// Puts accessors on the global object that define the real globals on
+// first access. The completion value is called once per group; the native
+// defineGroup function defines all globals of the group at once.
+
+(function (defineGroup, group, names) {
+  names = names.split(",");
+
+  const materialize = () => {
+    // The accessors must be gone before the real globals are defined. If
+    // defining them fails, they're put back so the next access can retry.
+    const accessors = names.map((name) =>
+      Object.getOwnPropertyDescriptor(globalThis, name)
+    );
+    for (const name of names) {
+      delete globalThis[name];
+    }
+    try {
+      defineGroup(group);
+    } catch (e) {
+      names.forEach((name, i) => {
+        if (accessors[i] && !Object.hasOwn(globalThis, name)) {
+          Object.defineProperty(globalThis, name, accessors[i]);
+        }
+      });
+      throw e;
+    }
+  };
+
+  for (const name of names) {
+    Object.defineProperty(globalThis, name, {
+      configurable: true,
+      enumerable: false,
+      get() {
+        materialize();
+        return globalThis[name];
+      },
+      set(value) {
+        materialize();
+        globalThis[name] = value;
+      },
+    });
+  }
+});
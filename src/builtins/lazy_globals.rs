@@ -0,0 +1,125 @@
+//! Globals that are only defined when scripts first use them. Most apps
+//! never touch most of these, and building their classes and objects in
+//! every realm adds up with many workers.
+//!
+//! Each group of globals gets accessors on the global object, which are
+//! replaced by the real globals when any of them is accessed.
+
+use std::cell::Cell;
+
+use anyhow::{anyhow, Context as _};
+use ion::{conversions::ToValue, function_spec, Context, Function, Object};
+use mozjs_sys::jsapi::JSFunctionSpec;
+
+use crate::sm_utils;
+
+const INSTALLER_SCRIPT: &str = include_str!("lazy_globals.js");
+
+struct LazyGlobal {
+    group: &'static str,
+    /// All the globals `define` creates.
+    names: &'static [&'static str],
+    define: fn(&Context, &Object) -> bool,
+}
+
+const LAZY_GLOBALS: &[LazyGlobal] = &[
+    LazyGlobal {
+        group: "crypto",
+        names: &["crypto", "CryptoKey", "KeyAlgorithm", "HmacKeyAlgorithm"],
+        define: super::crypto::define,
+    },
+    LazyGlobal {
+        group: "cache",
+        names: &["caches", "Cache", "CacheStorage"],
+        define: super::cache::define,
+    },
+    LazyGlobal {
+        group: "navigator",
+        names: &["navigator", "Navigator"],
+        define: define_navigator,
+    },
+    LazyGlobal {
+        group: "performance",
+        names: &["performance"],
+        define: super::performance::define,
+    },
+    LazyGlobal {
+        group: "process",
+        names: &["process"],
+        define: super::process::define,
+    },
+];
+
+thread_local! {
+    static HARDWARE_CONCURRENCY: Cell<u32> = Cell::new(1);
+}
+
+fn define_navigator(cx: &Context, global: &Object) -> bool {
+    super::navigator::define(cx, global, HARDWARE_CONCURRENCY.get())
+}
+
+#[js_fn]
+fn define_lazy_global(cx: &Context, group: String) -> ion::Result<()> {
+    let lazy = LAZY_GLOBALS
+        .iter()
+        .find(|g| g.group == group)
+        .ok_or_else(|| ion::Error::new("Unknown lazy global", ion::ErrorKind::Normal))?;
+
+    tracing::trace!("Defining lazy globals for {group}");
+    if (lazy.define)(cx, &Object::global(cx)) {
+        Ok(())
+    } else {
+        Err(ion::Error::new(
+            &format!("Failed to define {group} globals"),
+            ion::ErrorKind::Normal,
+        ))
+    }
+}
+
+static METHODS: &[JSFunctionSpec] = &[
+    function_spec!(define_lazy_global, "defineLazyGlobal", 1),
+    JSFunctionSpec::ZERO,
+];
+
+pub fn define(cx: &Context, hardware_concurrency: u32) -> bool {
+    HARDWARE_CONCURRENCY.set(hardware_concurrency);
+
+    match install(cx) {
+        Ok(()) => true,
+        Err(e) => {
+            tracing::error!(error = %e, "Failed to install lazy globals");
+            false
+        }
+    }
+}
+
+fn install(cx: &Context) -> anyhow::Result<()> {
+    let natives = Object::new(cx);
+    if !unsafe { natives.define_methods(cx, METHODS) } {
+        anyhow::bail!("Failed to define native functions");
+    }
+    let installer = sm_utils::evaluate_script(cx, INSTALLER_SCRIPT, "lazy_globals.js")
+        .context("Failed to evaluate lazy globals installer")?;
+    let installer = installer
+        .handle()
+        .is_object()
+        .then(|| Function::from_object(cx, &installer.to_object(cx)))
+        .flatten()
+        .ok_or_else(|| anyhow!("Lazy globals installer is not a function"))?;
+
+    for lazy in LAZY_GLOBALS {
+        let define_group = natives
+            .get(cx, "defineLazyGlobal")
+            .ok()
+            .flatten()
+            .ok_or_else(|| anyhow!("defineLazyGlobal is missing"))?;
+        let group = lazy.group.as_value(cx);
+        let names = lazy.names.join(",").as_value(cx);
+        installer
+            .call(cx, &Object::null(cx), &[define_group, group, names])
+            .map_err(|e| sm_utils::error_report_option_to_anyhow_error(cx, e))
+            .with_context(|| format!("Failed to install lazy {} globals", lazy.group))?;
+    }
+
+    Ok(())
+}
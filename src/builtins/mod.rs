@@ -6,9 +6,11 @@ pub mod core;
 pub mod crypto;
 pub mod internal_js_modules;
 pub mod js_globals;
+mod lazy_globals;
 pub mod navigator;
 pub mod performance;
 pub mod process;
+pub mod static_response;
 
 pub struct Modules {
     pub include_internal: bool,
@@ -21,25 +23,18 @@ impl Modules {
             && init_global_module::<modules::FileSystem>(cx, global)
             && init_global_module::<modules::PathM>(cx, global)
             && init_global_module::<modules::UrlM>(cx, global)
-            && performance::define(cx, global)
-            && process::define(cx, global)
-            && crypto::define(cx, global)
-            && cache::define(cx, global)
-            && navigator::define(cx, global, self.hardware_concurrency)
+            && lazy_globals::define(cx, self.hardware_concurrency)
+            && static_response::define(cx)
     }
 }
 
 impl StandardModules for Modules {
     fn init(self, cx: &Context, global: &ion::Object) -> bool {
-        let result = init_module::<core::CoreModule>(cx, global)
+        // Internal modules are registered when they are first imported,
+        // see internal_js_modules::Loader.
+        init_module::<core::CoreModule>(cx, global)
             && self.define_common(cx, global)
-            && js_globals::define(cx);
-
-        if self.include_internal {
-            result && internal_js_modules::define(cx)
-        } else {
-            result
-        }
+            && js_globals::define(cx)
     }
 
     fn init_globals(self, cx: &Context, global: &ion::Object) -> bool {
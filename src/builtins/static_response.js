@@ -0,0 +1,16 @@
+// Defines Response.static, which creates a response that can be returned
+// from any number of requests. The completion value is called with the
+// native function that snapshots the response.
+
+(function (register) {
+  Object.defineProperty(Response, "static", {
+    configurable: true,
+    enumerable: false,
+    writable: true,
+    value: function (body, init) {
+      const response = new Response(body, init);
+      register(response);
+      return response;
+    },
+  });
+});
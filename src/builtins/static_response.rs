@@ -0,0 +1,149 @@
+//! `Response.static(body, init)` creates a response that can be returned
+//! for any number of requests, which suits health checks, redirects and
+//! other constant endpoints:
+//!
+//! ```js
+//! const ok = Response.static("OK", { headers: { "content-type": "text/plain" } });
+//! addEventListener("fetch", (event) => event.respondWith(ok));
+//! ```
+//!
+//! The status, headers and body are snapshotted when the response is
+//! created, and the headers can't be changed afterwards. Returning it sends
+//! the snapshot to hyper without touching the JS object, so its body is
+//! never consumed. Only in-memory bodies are supported, since a stream can
+//! only be read once.
+
+use std::{cell::RefCell, collections::HashMap, rc::Rc};
+
+use anyhow::{anyhow, Context as _};
+use bytes::Bytes;
+use ion::{function_spec, ClassDefinition, Context, Function, Object, PermanentHeap};
+use mozjs_sys::jsapi::{JSFunctionSpec, JSObject};
+use runtime::globals::fetch::{FetchBodyInner, Headers, HeadersGuard, Response};
+
+use crate::sm_utils;
+
+const INSTALLER_SCRIPT: &str = include_str!("static_response.js");
+
+// Every static response is kept alive for the lifetime of the worker, so
+// they should be created once, not per request.
+const MAX_STATIC_RESPONSES: usize = 1024;
+
+struct StaticResponse {
+    // Keeps the JS object, and so its native response, alive.
+    _object: PermanentHeap<*mut JSObject>,
+    status: u16,
+    headers: http::HeaderMap,
+    body: Bytes,
+}
+
+thread_local! {
+    // Keyed by the address of the native response, which stays the same
+    // even when the GC moves the JS object around.
+    static STATIC_RESPONSES: RefCell<HashMap<*const Response, Rc<StaticResponse>>> =
+        RefCell::new(HashMap::new());
+}
+
+#[js_fn]
+fn register_static_response(cx: &Context, response: Object) -> ion::Result<()> {
+    let type_error = |message: &str| ion::Error::new(message, ion::ErrorKind::Type);
+
+    if STATIC_RESPONSES.with(|r| r.borrow().len()) >= MAX_STATIC_RESPONSES {
+        return Err(type_error(
+            "Too many static responses, create them once instead of per request",
+        ));
+    }
+
+    if !Response::instance_of(cx, &response) {
+        return Err(type_error("Expected a Response"));
+    }
+    let original = Response::get_mut_private(cx, &response).unwrap();
+
+    // Snapshot a clone, so the returned Response keeps its own body.
+    let mut snapshot = original.try_clone(cx)?;
+    let body = snapshot
+        .take_body()
+        .map_err(|e| type_error(&format!("Failed to read response body: {e:?}")))?;
+    let body = match body.body {
+        FetchBodyInner::Bytes(bytes) => bytes,
+        FetchBodyInner::Stream(_) => {
+            return Err(type_error(
+                "Static responses must have a string, buffer or blob body",
+            ))
+        }
+    };
+
+    // What's sent is the snapshot, so the headers can't be allowed to
+    // change after this.
+    let headers = Object::from(cx.root(original.get_headers()));
+    Headers::get_mut_private(cx, &headers).unwrap().guard = HeadersGuard::Immutable;
+
+    // hyper sets the Content-Length from the body where it belongs.
+    let entry = StaticResponse {
+        _object: PermanentHeap::from_local(&response),
+        status: snapshot.get_status(),
+        headers: snapshot.headers(cx).clone(),
+        body,
+    };
+    let key: *const Response = original;
+    STATIC_RESPONSES.with(|r| r.borrow_mut().insert(key, Rc::new(entry)));
+    Ok(())
+}
+
+/// Builds the hyper response for `value`, if it was created by
+/// `Response.static`.
+pub fn lookup(cx: &Context, value: &Object) -> Option<hyper::Response<hyper::Body>> {
+    if !Response::instance_of(cx, value) {
+        return None;
+    }
+    let key: *const Response = Response::get_private(cx, value).unwrap();
+    let entry = STATIC_RESPONSES.with(|r| r.borrow().get(&key).cloned())?;
+
+    // The headers share their names and values, and the body shares its
+    // buffer, so this only allocates the header map.
+    let mut response = hyper::Response::new(hyper::Body::from(entry.body.clone()));
+    *response.status_mut() = http::StatusCode::from_u16(entry.status).ok()?;
+    *response.headers_mut() = entry.headers.clone();
+    Some(response)
+}
+
+static METHODS: &[JSFunctionSpec] = &[
+    function_spec!(register_static_response, "registerStaticResponse", 1),
+    JSFunctionSpec::ZERO,
+];
+
+pub fn define(cx: &Context) -> bool {
+    match install(cx) {
+        Ok(()) => true,
+        Err(e) => {
+            tracing::error!(error = %e, "Failed to define Response.static");
+            false
+        }
+    }
+}
+
+fn install(cx: &Context) -> anyhow::Result<()> {
+    let natives = Object::new(cx);
+    if !unsafe { natives.define_methods(cx, METHODS) } {
+        anyhow::bail!("Failed to define native functions");
+    }
+    let register = natives
+        .get(cx, "registerStaticResponse")
+        .ok()
+        .flatten()
+        .ok_or_else(|| anyhow!("registerStaticResponse is missing"))?;
+
+    let installer = sm_utils::evaluate_script(cx, INSTALLER_SCRIPT, "static_response.js")
+        .context("Failed to evaluate Response.static installer")?;
+    let installer = installer
+        .handle()
+        .is_object()
+        .then(|| Function::from_object(cx, &installer.to_object(cx)))
+        .flatten()
+        .ok_or_else(|| anyhow!("Response.static installer is not a function"))?;
+
+    installer
+        .call(cx, &Object::null(cx), &[register])
+        .map_err(|e| sm_utils::error_report_option_to_anyhow_error(cx, e))?;
+    Ok(())
+}
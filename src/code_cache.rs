@@ -0,0 +1,213 @@
+//! Compiles user code to SpiderMonkey stencils once per process and shares
+//! them between all JS runtimes. Stencils are immutable, reference-counted
+//! and not tied to the runtime that compiled them, so each worker only has
+//! to instantiate the stencil instead of parsing and compiling the code
+//! again, and the bytecode is kept in memory once.
+//!
+//! Stencils are keyed by file name and a hash of the source. The first
+//! worker that needs one compiles it; workers starting at the same time
+//! wait for it instead of compiling it themselves. Only the latest version
+//! of each file is kept.
+//!
+//! If a cache directory is set, stencils are also kept on disk, and loaded
+//! from there by later processes.
+
+use std::{collections::HashMap, ptr, sync::Arc, time::Instant};
+
+use anyhow::Context as _;
+use ion::{Context, ErrorReport, Object, Value};
+use mozjs::{
+    jsapi::{
+        CompileGlobalScriptToStencil1, CompileModuleScriptToStencil1, InstantiateGlobalStencil,
+        InstantiateModuleStencil, InstantiateOptions, JSObject, JSScript, Stencil, StencilAddRef,
+        StencilRelease,
+    },
+    rust::{transform_str_to_source_text, wrappers::JS_ExecuteScript, CompileOptionsWrapper},
+};
+use once_cell::sync::OnceCell;
+use sha2::{Digest, Sha256};
+
+mod disk;
+
+pub use disk::enable as enable_disk_cache;
+
+/// A reference to a compiled stencil, usable from any thread.
+pub struct SharedStencil(*mut Stencil);
+
+// Stencils are immutable once compiled and their reference count is atomic.
+unsafe impl Send for SharedStencil {}
+unsafe impl Sync for SharedStencil {}
+
+impl Clone for SharedStencil {
+    fn clone(&self) -> Self {
+        unsafe { StencilAddRef(self.0) };
+        Self(self.0)
+    }
+}
+
+impl Drop for SharedStencil {
+    fn drop(&mut self) {
+        unsafe { StencilRelease(self.0) };
+    }
+}
+
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+pub enum CodeKind {
+    Script,
+    Module,
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+struct StencilKey {
+    kind: CodeKind,
+    file_name: String,
+    source_hash: [u8; 32],
+}
+
+type StencilSlot = Arc<OnceCell<SharedStencil>>;
+
+lazy_static::lazy_static! {
+    static ref STENCILS: parking_lot::Mutex<HashMap<StencilKey, StencilSlot>> = Default::default();
+}
+
+/// Returns the stencil for the given code, compiling it with `cx` if no
+/// other runtime has done so yet.
+pub fn get_or_compile(
+    cx: &Context,
+    kind: CodeKind,
+    file_name: &str,
+    code: &str,
+) -> anyhow::Result<SharedStencil> {
+    get_or_compile_as(cx, kind, file_name, file_name, code)
+}
+
+/// Like [`get_or_compile`], but keys the stencil by `cache_name` instead
+/// of the file name it's compiled with, for files whose name alone doesn't
+/// tell them apart.
+pub fn get_or_compile_as(
+    cx: &Context,
+    kind: CodeKind,
+    cache_name: &str,
+    file_name: &str,
+    code: &str,
+) -> anyhow::Result<SharedStencil> {
+    let key = StencilKey {
+        kind,
+        file_name: cache_name.to_string(),
+        source_hash: Sha256::digest(code.as_bytes()).into(),
+    };
+    let slot = {
+        let mut stencils = STENCILS.lock();
+        match stencils.get(&key) {
+            Some(slot) => slot.clone(),
+            None => {
+                // The file changed, e.g. in watch mode. Workers that still
+                // use the old stencil keep their own reference to it.
+                stencils.retain(|k, _| k.kind != kind || k.file_name != key.file_name);
+                let slot = StencilSlot::default();
+                stencils.insert(key.clone(), slot.clone());
+                slot
+            }
+        }
+    };
+
+    // Compilation errors aren't cached, every worker reports them itself.
+    slot.get_or_try_init(|| {
+        if let Some(stencil) = disk::load(cx, &key) {
+            return Ok(stencil);
+        }
+
+        let started = Instant::now();
+        let stencil = compile(cx, kind, file_name, code)?;
+        tracing::debug!(
+            "Compiled {file_name} in {} ms",
+            started.elapsed().as_millis()
+        );
+        disk::store(cx, &key, &stencil);
+        Ok(stencil)
+    })
+    .cloned()
+}
+
+fn compile(
+    cx: &Context,
+    kind: CodeKind,
+    file_name: &str,
+    code: &str,
+) -> anyhow::Result<SharedStencil> {
+    let options = unsafe { CompileOptionsWrapper::new(cx.as_ptr(), file_name, 1) };
+    let mut source = transform_str_to_source_text(code);
+    let stencil = unsafe {
+        match kind {
+            CodeKind::Script => {
+                CompileGlobalScriptToStencil1(cx.as_ptr(), options.ptr as *const _, &mut source)
+            }
+            CodeKind::Module => {
+                CompileModuleScriptToStencil1(cx.as_ptr(), options.ptr as *const _, &mut source)
+            }
+        }
+    }
+    .mRawPtr;
+
+    if stencil.is_null() {
+        return Err(pending_error(cx)).context("Failed to compile user code");
+    }
+    Ok(SharedStencil(stencil))
+}
+
+fn instantiate_options() -> InstantiateOptions {
+    InstantiateOptions {
+        skipFilenameValidation: false,
+        hideScriptFromDebugger: false,
+        deferDebugMetadata: false,
+    }
+}
+
+/// Instantiates a script stencil in the runtime of `cx` and runs it.
+pub fn evaluate_script_stencil<'cx>(
+    cx: &'cx Context,
+    stencil: &SharedStencil,
+) -> anyhow::Result<Value<'cx>> {
+    let options = instantiate_options();
+    let script: *mut JSScript =
+        unsafe { InstantiateGlobalStencil(cx.as_ptr(), &options, stencil.0, ptr::null_mut()) };
+    if script.is_null() {
+        return Err(pending_error(cx)).context("Failed to instantiate user code");
+    }
+
+    let script = cx.root(script);
+    let mut rval = Value::undefined(cx);
+    if unsafe {
+        JS_ExecuteScript(
+            cx.as_ptr(),
+            script.handle().into(),
+            rval.handle_mut().into(),
+        )
+    } {
+        Ok(rval)
+    } else {
+        Err(pending_error(cx))
+    }
+}
+
+/// Instantiates a module stencil in the runtime of `cx`. The module still
+/// has to be linked and evaluated.
+pub fn instantiate_module_stencil<'cx>(
+    cx: &'cx Context,
+    stencil: &SharedStencil,
+) -> anyhow::Result<Object<'cx>> {
+    let options = instantiate_options();
+    let module: *mut JSObject =
+        unsafe { InstantiateModuleStencil(cx.as_ptr(), &options, stencil.0, ptr::null_mut()) };
+    if module.is_null() {
+        return Err(pending_error(cx)).context("Failed to instantiate user code");
+    }
+    Ok(Object::from(cx.root(module)))
+}
+
+fn pending_error(cx: &Context) -> anyhow::Error {
+    crate::sm_utils::error_report_option_to_anyhow_error(
+        cx,
+        ErrorReport::new_with_exception_stack(cx),
+    )
+}
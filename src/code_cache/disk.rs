@@ -0,0 +1,144 @@
+//! Keeps serialized stencils on disk, so restarted processes can skip
+//! parsing and compiling code they have seen before. Entries are written
+//! once and never modified; a different source, engine or WinterJS version
+//! leads to a different file name.
+
+use std::{
+    ffi::CStr,
+    fs,
+    io::Write,
+    path::{Path, PathBuf},
+};
+
+use anyhow::{bail, Context as _};
+use ion::Context;
+use mozjs::jsapi::{JSContext, JS_ClearPendingException, JS_GetImplementationVersion, Stencil};
+use once_cell::sync::OnceCell;
+use sha2::{Digest, Sha256};
+
+use super::{SharedStencil, StencilKey};
+
+extern "C" {
+    fn winterjs_set_build_id(id: *const u8, len: usize);
+    fn winterjs_encode_stencil(
+        cx: *mut JSContext,
+        stencil: *mut Stencil,
+        data: *mut *mut u8,
+        len: *mut usize,
+    ) -> bool;
+    fn winterjs_free_transcode_buffer(data: *mut u8);
+    fn winterjs_decode_stencil(cx: *mut JSContext, data: *const u8, len: usize) -> *mut Stencil;
+}
+
+struct DiskCache {
+    dir: PathBuf,
+    build_id: String,
+}
+
+static DISK_CACHE: OnceCell<DiskCache> = OnceCell::new();
+
+/// Enables the disk cache. Must be called before any code is compiled.
+pub fn enable(dir: &Path) -> anyhow::Result<()> {
+    fs::create_dir_all(dir)
+        .with_context(|| format!("Failed to create code cache directory '{}'", dir.display()))?;
+
+    let engine_version = unsafe { CStr::from_ptr(JS_GetImplementationVersion()) };
+    let build_id = format!(
+        "winterjs-{}/{}",
+        env!("CARGO_PKG_VERSION"),
+        engine_version.to_string_lossy()
+    );
+    unsafe { winterjs_set_build_id(build_id.as_ptr(), build_id.len()) };
+
+    if DISK_CACHE
+        .set(DiskCache {
+            dir: dir.to_owned(),
+            build_id,
+        })
+        .is_err()
+    {
+        bail!("Code cache directory was already set");
+    }
+    Ok(())
+}
+
+fn entry_path(cache: &DiskCache, key: &StencilKey) -> PathBuf {
+    let mut hasher = Sha256::new();
+    hasher.update(cache.build_id.as_bytes());
+    hasher.update([key.kind as u8]);
+    hasher.update(key.file_name.as_bytes());
+    hasher.update(key.source_hash);
+
+    let name: String = hasher
+        .finalize()
+        .iter()
+        .map(|b| format!("{b:02x}"))
+        .collect();
+    cache.dir.join(format!("{name}.stencil"))
+}
+
+/// Loads the stencil for `key`, if the disk cache is enabled and has it.
+pub(super) fn load(cx: &Context, key: &StencilKey) -> Option<SharedStencil> {
+    let cache = DISK_CACHE.get()?;
+    let path = entry_path(cache, key);
+    let data = fs::read(&path).ok()?;
+
+    let stencil = unsafe { winterjs_decode_stencil(cx.as_ptr(), data.as_ptr(), data.len()) };
+    if stencil.is_null() {
+        // Corrupt, or written by an engine we can't read. It'll be replaced
+        // once the code is compiled.
+        tracing::debug!("Ignoring unusable code cache entry {}", path.display());
+        unsafe { JS_ClearPendingException(cx.as_ptr()) };
+        return None;
+    }
+
+    tracing::debug!("Loaded {} from the code cache", key.file_name);
+    Some(SharedStencil(stencil))
+}
+
+/// Writes the stencil for `key` to the disk cache, if it is enabled.
+pub(super) fn store(cx: &Context, key: &StencilKey, stencil: &SharedStencil) {
+    let Some(cache) = DISK_CACHE.get() else {
+        return;
+    };
+
+    if let Err(e) = store_inner(cx, cache, key, stencil) {
+        tracing::warn!(error = %e, "Failed to write {} to the code cache", key.file_name);
+        unsafe { JS_ClearPendingException(cx.as_ptr()) };
+    }
+}
+
+fn store_inner(
+    cx: &Context,
+    cache: &DiskCache,
+    key: &StencilKey,
+    stencil: &SharedStencil,
+) -> anyhow::Result<()> {
+    let mut data = std::ptr::null_mut();
+    let mut len = 0;
+    if !unsafe { winterjs_encode_stencil(cx.as_ptr(), stencil.0, &mut data, &mut len) } {
+        bail!("Failed to serialize stencil");
+    }
+
+    let bytes = unsafe { std::slice::from_raw_parts(data, len) };
+    let result = write_atomically(&entry_path(cache, key), bytes);
+    unsafe { winterjs_free_transcode_buffer(data) };
+    result
+}
+
+// Other processes may read the entry while we're writing it, so it only
+// appears under its final name once it's complete.
+fn write_atomically(path: &Path, bytes: &[u8]) -> anyhow::Result<()> {
+    let tmp_path = path.with_extension(format!("tmp-{}", std::process::id()));
+    let result = (|| {
+        let mut file = fs::File::create(&tmp_path)?;
+        file.write_all(bytes)?;
+        file.sync_all()?;
+        fs::rename(&tmp_path, path)
+    })();
+
+    if result.is_err() {
+        _ = fs::remove_file(&tmp_path);
+    }
+    result.with_context(|| format!("Failed to write '{}'", path.display()))
+}
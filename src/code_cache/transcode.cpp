@@ -0,0 +1,55 @@
+// Serializes stencils for the on-disk code cache. SpiderMonkey's transcoding
+// API works on mozilla::Vector, which can't be created from Rust, so these
+// wrappers hand out plain buffers instead.
+
+#include <string>
+
+#include <js/BuildId.h>
+#include <js/Transcoding.h>
+#include <js/Utility.h>
+#include <js/experimental/JSStencil.h>
+
+static std::string gBuildId;
+
+static bool GetBuildId(JS::BuildIdCharVector* buildId) {
+  return buildId->append(gBuildId.data(), gBuildId.size());
+}
+
+extern "C" {
+
+// Cached stencils are only decoded by builds with the same build id.
+void winterjs_set_build_id(const char* id, size_t len) {
+  gBuildId.assign(id, len);
+  JS::SetProcessBuildIdOp(GetBuildId);
+}
+
+// On success, the buffer must be freed with winterjs_free_transcode_buffer.
+bool winterjs_encode_stencil(JSContext* cx, JS::Stencil* stencil,
+                             uint8_t** data, size_t* len) {
+  JS::TranscodeBuffer buffer;
+  if (JS::EncodeStencil(cx, stencil, buffer) != JS::TranscodeResult::Ok) {
+    return false;
+  }
+
+  *len = buffer.length();
+  *data = buffer.extractOrCopyRawBuffer();
+  return *data != nullptr;
+}
+
+void winterjs_free_transcode_buffer(uint8_t* data) { js_free(data); }
+
+// Returns a new reference to the decoded stencil, or null if the data is
+// invalid or was written by a different build.
+JS::Stencil* winterjs_decode_stencil(JSContext* cx, const uint8_t* data,
+                                     size_t len) {
+  JS::DecodeOptions options;
+  JS::TranscodeRange range(data, len);
+  JS::Stencil* stencil = nullptr;
+  if (JS::DecodeStencil(cx, options, range, &stencil) !=
+      JS::TranscodeResult::Ok) {
+    return nullptr;
+  }
+  return stencil;
+}
+
+}  // extern "C"
@@ -0,0 +1,460 @@
+//! A shared HTTP cache in front of the JS workers. Responses that
+//! `Cache-Control` allows shared caches to keep are stored in memory, and
+//! later requests for them are answered on the hyper threads without
+//! involving JS at all.
+//!
+//! Supported:
+//! * `s-maxage` and `max-age`, with `s-maxage` taking precedence, minus
+//!   the response's `Age`.
+//! * `stale-while-revalidate`: stale entries within the window are served
+//!   while a single background request refreshes them.
+//! * `Vary`: entries only match requests with the same values for the
+//!   listed headers. `Vary: *` is never cached.
+//! * `no-store`, `no-cache` and `private` responses are not stored, and
+//!   neither are responses that set cookies or answer requests with
+//!   credentials.
+//!
+//! Only GET requests are cached, and HEAD requests are answered from the
+//! same entries. Bodies must have a known size below the entry size limit,
+//! everything else goes straight through.
+
+use std::{
+    collections::{hash_map::DefaultHasher, HashMap, VecDeque},
+    hash::{Hash, Hasher},
+    net::SocketAddr,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Weak,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::Context as _;
+use bytes::Bytes;
+use http::{header, HeaderMap, HeaderValue, Method, StatusCode};
+use hyper::{body::HttpBody, Body, Response};
+
+use crate::server::BoxedDynRunner;
+
+const SHARDS: usize = 16;
+
+#[derive(Clone, Copy, Debug)]
+pub struct HttpCacheConfig {
+    pub max_bytes: usize,
+}
+
+pub struct HttpCache {
+    shards: Box<[parking_lot::Mutex<Shard>]>,
+    max_shard_bytes: usize,
+    // Larger responses would push too much else out of the cache.
+    max_entry_bytes: usize,
+}
+
+#[derive(Default)]
+struct Shard {
+    entries: HashMap<String, Vec<Arc<Entry>>>,
+    // Number of entries in `entries`.
+    len: usize,
+    // Insertion order, oldest first, for eviction. Entries that were
+    // replaced or removed are left in place and skipped when they come up,
+    // so that removing an entry doesn't need a scan.
+    order: VecDeque<(String, Weak<Entry>)>,
+    bytes: usize,
+}
+
+impl Shard {
+    fn remove_at(&mut self, key: &str, index: usize) -> Arc<Entry> {
+        let variants = self.entries.get_mut(key).unwrap();
+        let entry = variants.swap_remove(index);
+        if variants.is_empty() {
+            self.entries.remove(key);
+        }
+        self.len -= 1;
+        self.bytes -= entry.size();
+        entry
+    }
+
+    fn position(&self, key: &str, entry: *const Entry) -> Option<usize> {
+        self.entries
+            .get(key)?
+            .iter()
+            .position(|e| std::ptr::eq(Arc::as_ptr(e), entry))
+    }
+
+    fn push(&mut self, key: String, entry: Arc<Entry>) {
+        self.order.push_back((key.clone(), Arc::downgrade(&entry)));
+        self.bytes += entry.size();
+        self.len += 1;
+        self.entries.entry(key).or_default().push(entry);
+
+        // Drop the skipped entries once they make up most of the queue, so
+        // it doesn't grow without bounds when entries are replaced often.
+        if self.order.len() > 2 * self.len + 16 {
+            let order = std::mem::take(&mut self.order);
+            self.order = order
+                .into_iter()
+                .filter(|(key, entry)| self.position(key, entry.as_ptr()).is_some())
+                .collect();
+        }
+    }
+
+    // Removes the oldest entry. Returns false if there are none.
+    fn evict_oldest(&mut self) -> bool {
+        while let Some((key, entry)) = self.order.pop_front() {
+            if let Some(index) = self.position(&key, entry.as_ptr()) {
+                self.remove_at(&key, index);
+                return true;
+            }
+        }
+        false
+    }
+}
+
+struct Entry {
+    status: StatusCode,
+    headers: HeaderMap,
+    body: Bytes,
+    /// The request headers named by `Vary`, and their values.
+    vary: Vec<(header::HeaderName, Option<HeaderValue>)>,
+    stored: Instant,
+    /// Age of the response when it was stored.
+    initial_age: Duration,
+    fresh_for: Duration,
+    stale_while_revalidate: Duration,
+    revalidating: AtomicBool,
+}
+
+impl Entry {
+    fn size(&self) -> usize {
+        self.body.len()
+            + self
+                .headers
+                .iter()
+                .map(|(n, v)| n.as_str().len() + v.len())
+                .sum::<usize>()
+    }
+
+    fn age(&self) -> Duration {
+        self.initial_age + self.stored.elapsed()
+    }
+
+    fn matches(&self, request: &HeaderMap) -> bool {
+        self.vary
+            .iter()
+            .all(|(name, value)| request.get(name) == value.as_ref())
+    }
+
+    fn to_response(&self, with_body: bool) -> Response<Body> {
+        let body = if with_body {
+            Body::from(self.body.clone())
+        } else {
+            Body::empty()
+        };
+        let mut response = Response::new(body);
+        *response.status_mut() = self.status;
+        *response.headers_mut() = self.headers.clone();
+        response
+            .headers_mut()
+            .insert(header::AGE, HeaderValue::from(self.age().as_secs()));
+        response
+    }
+}
+
+enum Lookup {
+    Fresh(Arc<Entry>),
+    Stale(Arc<Entry>),
+    Miss,
+}
+
+#[derive(Default)]
+struct Directives {
+    max_age: Option<u64>,
+    s_maxage: Option<u64>,
+    stale_while_revalidate: Option<u64>,
+    no_store: bool,
+    no_cache: bool,
+    private: bool,
+}
+
+impl Directives {
+    fn parse(headers: &HeaderMap) -> Self {
+        let mut directives = Self::default();
+        for value in headers.get_all(header::CACHE_CONTROL) {
+            let Ok(value) = value.to_str() else {
+                continue;
+            };
+            for directive in value.split(',') {
+                let (name, arg) = match directive.split_once('=') {
+                    Some((name, arg)) => (name.trim(), Some(arg.trim().trim_matches('"'))),
+                    None => (directive.trim(), None),
+                };
+                let seconds = || arg.and_then(|a| a.parse().ok());
+                match name.to_ascii_lowercase().as_str() {
+                    "max-age" => directives.max_age = seconds(),
+                    "s-maxage" => directives.s_maxage = seconds(),
+                    "stale-while-revalidate" => directives.stale_while_revalidate = seconds(),
+                    "no-store" => directives.no_store = true,
+                    "no-cache" => directives.no_cache = true,
+                    "private" => directives.private = true,
+                    _ => (),
+                }
+            }
+        }
+        directives
+    }
+}
+
+impl HttpCache {
+    pub fn new(config: HttpCacheConfig) -> Self {
+        let max_shard_bytes = config.max_bytes / SHARDS;
+        Self {
+            shards: (0..SHARDS).map(|_| Default::default()).collect(),
+            max_shard_bytes,
+            max_entry_bytes: max_shard_bytes / 4,
+        }
+    }
+
+    /// Answers the request from the cache if possible, and otherwise
+    /// passes it on to the runner, storing the response if it's cacheable.
+    pub async fn handle(
+        self: &Arc<Self>,
+        runner: &BoxedDynRunner,
+        addr: SocketAddr,
+        req: http::request::Parts,
+        body: Body,
+    ) -> anyhow::Result<Response<Body>> {
+        let Some(key) = cache_key(&req) else {
+            return runner.handle(addr, req, body).await;
+        };
+        let with_body = req.method != Method::HEAD;
+
+        match self.lookup(&key, &req.headers) {
+            Lookup::Fresh(entry) => Ok(entry.to_response(with_body)),
+            Lookup::Stale(entry) => {
+                if !entry.revalidating.swap(true, Ordering::AcqRel) {
+                    let cache = self.clone();
+                    let runner = runner.clone();
+                    let req = revalidation_request(&req);
+                    let stale = entry.clone();
+                    tokio::spawn(async move {
+                        let fetched = cache
+                            .fetch(&runner, addr, key, req, Body::empty(), Some(&stale))
+                            .await;
+                        if let Err(e) = fetched {
+                            tracing::debug!(error = %e, "Background revalidation failed");
+                        }
+                        stale.revalidating.store(false, Ordering::Release);
+                    });
+                }
+                Ok(entry.to_response(with_body))
+            }
+            // The script may answer HEAD requests differently, so only GET
+            // responses are stored.
+            Lookup::Miss if !with_body => runner.handle(addr, req, body).await,
+            Lookup::Miss => self.fetch(runner, addr, key, req, body, None).await,
+        }
+    }
+
+    async fn fetch(
+        &self,
+        runner: &BoxedDynRunner,
+        addr: SocketAddr,
+        key: String,
+        req: http::request::Parts,
+        body: Body,
+        stale: Option<&Arc<Entry>>,
+    ) -> anyhow::Result<Response<Body>> {
+        let request_headers = req.headers.clone();
+        let response = runner.handle(addr, req, body).await?;
+
+        let (response, entry) = self.to_entry(response, &request_headers).await?;
+        match entry {
+            Some(entry) => self.store(key, entry),
+            // The origin no longer lets us keep the response, so the stale
+            // one has to go too.
+            None => {
+                if let Some(stale) = stale {
+                    self.remove(&key, stale);
+                }
+            }
+        }
+
+        Ok(response)
+    }
+
+    // Builds a cache entry from the response if it can be stored. The
+    // response is handed back either way, since its body may have been read.
+    async fn to_entry(
+        &self,
+        response: Response<Body>,
+        request_headers: &HeaderMap,
+    ) -> anyhow::Result<(Response<Body>, Option<Arc<Entry>>)> {
+        let directives = Directives::parse(response.headers());
+        let Some(fresh_for) = storable_for(&response, &directives, request_headers) else {
+            return Ok((response, None));
+        };
+        match response.body().size_hint().exact() {
+            Some(len) if len as usize <= self.max_entry_bytes => (),
+            _ => return Ok((response, None)),
+        }
+
+        let (parts, body) = response.into_parts();
+        let body = hyper::body::to_bytes(body)
+            .await
+            .context("Failed to read response body")?;
+
+        let Some(vary) = vary_values(&parts.headers, request_headers) else {
+            return Ok((Response::from_parts(parts, Body::from(body)), None));
+        };
+        let initial_age = parts
+            .headers
+            .get(header::AGE)
+            .and_then(|v| v.to_str().ok())
+            .and_then(|v| v.parse().ok())
+            .map(Duration::from_secs)
+            .unwrap_or_default();
+
+        let entry = Entry {
+            status: parts.status,
+            headers: parts.headers.clone(),
+            body: body.clone(),
+            vary,
+            stored: Instant::now(),
+            initial_age,
+            fresh_for,
+            stale_while_revalidate: Duration::from_secs(
+                directives.stale_while_revalidate.unwrap_or(0),
+            ),
+            revalidating: AtomicBool::new(false),
+        };
+        let entry = (entry.size() <= self.max_entry_bytes).then(|| Arc::new(entry));
+
+        Ok((Response::from_parts(parts, Body::from(body)), entry))
+    }
+
+    fn shard(&self, key: &str) -> &parking_lot::Mutex<Shard> {
+        let mut hasher = DefaultHasher::new();
+        key.hash(&mut hasher);
+        &self.shards[hasher.finish() as usize % SHARDS]
+    }
+
+    fn lookup(&self, key: &str, request_headers: &HeaderMap) -> Lookup {
+        let mut shard = self.shard(key).lock();
+        let Some((index, entry)) = shard.entries.get(key).and_then(|entries| {
+            entries
+                .iter()
+                .enumerate()
+                .find(|(_, e)| e.matches(request_headers))
+        }) else {
+            return Lookup::Miss;
+        };
+
+        let age = entry.age();
+        if age < entry.fresh_for {
+            Lookup::Fresh(entry.clone())
+        } else if age < entry.fresh_for + entry.stale_while_revalidate {
+            Lookup::Stale(entry.clone())
+        } else {
+            // It can't be served any more, so there's no point in letting it
+            // take up room until it's evicted.
+            shard.remove_at(key, index);
+            Lookup::Miss
+        }
+    }
+
+    fn store(&self, key: String, entry: Arc<Entry>) {
+        let mut shard = self.shard(&key).lock();
+
+        // Replace whatever was stored for the same variant.
+        let existing = shard
+            .entries
+            .get(&key)
+            .and_then(|variants| variants.iter().position(|e| e.vary == entry.vary));
+        if let Some(index) = existing {
+            shard.remove_at(&key, index);
+        }
+        shard.push(key, entry);
+
+        while shard.bytes > self.max_shard_bytes && shard.evict_oldest() {}
+    }
+
+    fn remove(&self, key: &str, entry: &Arc<Entry>) {
+        let mut shard = self.shard(key).lock();
+        // Otherwise it was already evicted or replaced.
+        if let Some(index) = shard.position(key, Arc::as_ptr(entry)) {
+            shard.remove_at(key, index);
+        }
+    }
+}
+
+fn cache_key(req: &http::request::Parts) -> Option<String> {
+    if !matches!(req.method, Method::GET | Method::HEAD) {
+        return None;
+    }
+    if req.headers.contains_key(header::AUTHORIZATION) {
+        return None;
+    }
+    let directives = Directives::parse(&req.headers);
+    if directives.no_store || directives.no_cache {
+        return None;
+    }
+
+    let host = crate::request_handlers::get_host(&req.uri, &req.headers).ok()?;
+    let path_and_query = req.uri.path_and_query().map_or("/", |p| p.as_str());
+    Some(format!("{host}{path_and_query}"))
+}
+
+// How long the response stays fresh, if it may be stored at all.
+fn storable_for(
+    response: &Response<Body>,
+    directives: &Directives,
+    request_headers: &HeaderMap,
+) -> Option<Duration> {
+    let cacheable_status = matches!(
+        response.status().as_u16(),
+        200 | 203 | 204 | 300 | 301 | 308 | 404 | 405 | 410 | 414 | 501
+    );
+    if !cacheable_status
+        || directives.no_store
+        || directives.no_cache
+        || directives.private
+        || response.headers().contains_key(header::SET_COOKIE)
+        // The cookie isn't part of the key, so the response could end up
+        // being served to other users.
+        || request_headers.contains_key(header::COOKIE)
+    {
+        return None;
+    }
+
+    let max_age = directives.s_maxage.or(directives.max_age)?;
+    (max_age > 0).then(|| Duration::from_secs(max_age))
+}
+
+// None if the response varies on everything.
+fn vary_values(
+    response_headers: &HeaderMap,
+    request_headers: &HeaderMap,
+) -> Option<Vec<(header::HeaderName, Option<HeaderValue>)>> {
+    let mut vary = vec![];
+    for value in response_headers.get_all(header::VARY) {
+        for name in value.to_str().ok()?.split(',') {
+            let name = name.trim();
+            if name == "*" {
+                return None;
+            }
+            let name = header::HeaderName::from_bytes(name.as_bytes()).ok()?;
+            let value = request_headers.get(&name).cloned();
+            vary.push((name, value));
+        }
+    }
+    Some(vary)
+}
+
+fn revalidation_request(req: &http::request::Parts) -> http::request::Parts {
+    let mut request = http::Request::new(());
+    *request.method_mut() = Method::GET;
+    *request.uri_mut() = req.uri.clone();
+    *request.version_mut() = req.version;
+    *request.headers_mut() = req.headers.clone();
+    request.into_parts().0
+}
@@ -6,15 +6,14 @@ use std::{
     net::{IpAddr, SocketAddr},
     path::PathBuf,
     pin::Pin,
+    time::Duration,
 };
 
-#[cfg(not(target_os = "wasi"))]
-use std::time::Duration;
-
 use anyhow::Context as _;
 use clap::{Parser, ValueEnum};
 use request_handlers::{
-    cloudflare::CloudflareRequestHandler, wintercg::WinterCGRequestHandler, Either, UserCode,
+    cloudflare::CloudflareRequestHandler, wintercg::WinterCGRequestHandler, Either, RequestHandler,
+    UserCode,
 };
 
 use server::BoxedDynRunner;
@@ -46,12 +45,19 @@ macro_rules! js_try {
 }
 
 mod builtins;
+mod code_cache;
+mod http_cache;
+#[cfg(target_os = "linux")]
+mod prefork;
 mod request_handlers;
 mod runners;
 mod server;
 mod sm_utils;
+mod startup;
 
 fn main() {
+    startup::process_started();
+
     if let Err(e) = run() {
         println!("{e:?}");
     }
@@ -87,6 +93,10 @@ fn run() -> Result<(), anyhow::Error> {
                 .set(runtime::config::Config::default().log_level(runtime::config::LogLevel::Error))
                 .unwrap();
 
+            if let Some(dir) = &cmd.code_cache_dir {
+                code_cache::enable_disk_cache(dir)?;
+            }
+
             runners::exec::exec_script(cmd.js_path, cmd.script)
         }
 
@@ -112,7 +122,13 @@ fn run() -> Result<(), anyhow::Error> {
             };
 
             let addr: SocketAddr = (interface, port).into();
-            let config = crate::server::ServerConfig { addr };
+            let config = crate::server::ServerConfig {
+                addr,
+                reuse_port: cmd.processes.is_some(),
+                http_cache: cmd.http_cache_mb.map(|mb| http_cache::HttpCacheConfig {
+                    max_bytes: mb * 1024 * 1024,
+                }),
+            };
 
             runtime::config::CONFIG
                 .set(runtime::config::Config::default().log_level(runtime::config::LogLevel::Error))
@@ -120,6 +136,86 @@ fn run() -> Result<(), anyhow::Error> {
 
             let user_code = UserCode::from_path(&cmd.js_path, cmd.script)?;
 
+            if let Some(dir) = &cmd.code_cache_dir {
+                code_cache::enable_disk_cache(dir)?;
+            }
+
+            // Must happen before anything starts a thread.
+            #[cfg(target_os = "linux")]
+            let user_code = match cmd.processes {
+                Some(processes) => match prefork::run(prefork::PreforkConfig {
+                    processes,
+                    user_code,
+                    code_cache_dir: cmd.code_cache_dir.clone(),
+                })? {
+                    prefork::Role::Parent => return Ok(()),
+                    prefork::Role::Server { index, user_code } => {
+                        tracing::debug!("Starting server process #{index}");
+                        user_code
+                    }
+                },
+                None => user_code,
+            };
+            #[cfg(not(target_os = "linux"))]
+            if cmd.processes.is_some() {
+                anyhow::bail!("--processes is only supported on Linux");
+            }
+
+            let cpu_budget = runners::watchdog::CpuBudget {
+                per_request: cmd.request_cpu_budget_ms.map(Duration::from_millis),
+                per_task: cmd.task_cpu_budget_ms.map(Duration::from_millis),
+            };
+            let admission = runners::admission::AdmissionConfig {
+                max_queued_requests: cmd.max_queued_requests,
+                max_queue_wait: cmd.max_queue_wait_ms.map(Duration::from_millis),
+            };
+            let mut min_js_threads = if cmd.prewarm {
+                cmd.max_js_threads
+            } else {
+                cmd.min_js_threads.min(cmd.max_js_threads)
+            };
+            if cmd.startup_report.is_some() {
+                // Startup isn't complete without a worker, and workers
+                // started by requests would make the report depend on
+                // when traffic comes in.
+                min_js_threads = min_js_threads.max(1);
+            }
+            let runner_config = runners::single::SingleRunnerConfig {
+                max_threads: cmd.max_js_threads,
+                min_threads: min_js_threads,
+                admission: admission.clone(),
+                balancing: cmd.balancing_policy,
+                cpu_budget,
+                recycle: runners::RecyclePolicy {
+                    max_requests: cmd.recycle_after_requests,
+                    max_heap_bytes: cmd.recycle_heap_mb.map(|mb| mb * 1024 * 1024),
+                },
+            };
+            let watch = cmd.watch.then(|| runners::watch::WatchConfig {
+                js_path: cmd.js_path.clone(),
+                script_mode: cmd.script,
+            });
+            let thread_per_core = cmd.thread_per_core.then(|| {
+                let cores = std::thread::available_parallelism()
+                    .map(|n| n.get())
+                    .unwrap_or(1);
+                runners::thread_per_core::ThreadPerCoreRunnerConfig {
+                    addr,
+                    threads: cores.min(cmd.max_js_threads),
+                    admission: admission.clone(),
+                    cpu_budget,
+                }
+            });
+
+            if let Some(path) = cmd.startup_report {
+                let workers = match (&thread_per_core, cmd.single_threaded) {
+                    (_, true) => 1,
+                    (Some(config), false) => config.threads,
+                    (None, false) => min_js_threads,
+                };
+                startup::set_report_path(path, workers);
+            }
+
             let runner: Either<
                 BoxedDynRunner,
                 (
@@ -129,12 +225,12 @@ fn run() -> Result<(), anyhow::Error> {
             > = match (cmd.mode, cmd.single_threaded) {
                 (Some(HandlerName::Cloudflare), false) => {
                     tracing::info!("Starting in Cloudflare mode");
-                    Either::Left(Box::new(
-                        runners::single::SingleRunner::new_request_handler(
-                            CloudflareRequestHandler,
-                            cmd.max_js_threads,
-                            user_code,
-                        ),
+                    Either::Left(multi_threaded_runner(
+                        CloudflareRequestHandler,
+                        runner_config,
+                        thread_per_core,
+                        watch,
+                        user_code,
                     ))
                 }
                 (Some(HandlerName::Cloudflare), true) => {
@@ -142,17 +238,19 @@ fn run() -> Result<(), anyhow::Error> {
                     let (runner, future) = runners::inline::InlineRunner::new_request_handler(
                         CloudflareRequestHandler,
                         user_code,
+                        admission,
+                        cpu_budget,
                     );
                     Either::Right((Box::new(runner), Box::pin(future)))
                 }
                 (Some(HandlerName::WinterCG) | None, false) => {
                     tracing::info!("Starting in WinterCG mode");
-                    Either::Left(Box::new(
-                        runners::single::SingleRunner::new_request_handler(
-                            WinterCGRequestHandler,
-                            cmd.max_js_threads,
-                            user_code,
-                        ),
+                    Either::Left(multi_threaded_runner(
+                        WinterCGRequestHandler,
+                        runner_config,
+                        thread_per_core,
+                        watch,
+                        user_code,
                     ))
                 }
                 (Some(HandlerName::WinterCG) | None, true) => {
@@ -160,6 +258,8 @@ fn run() -> Result<(), anyhow::Error> {
                     let (runner, future) = runners::inline::InlineRunner::new_request_handler(
                         WinterCGRequestHandler,
                         user_code,
+                        admission,
+                        cpu_budget,
                     );
                     Either::Right((Box::new(runner), Box::pin(future)))
                 }
@@ -241,6 +341,28 @@ fn run() -> Result<(), anyhow::Error> {
     }
 }
 
+fn multi_threaded_runner<H: RequestHandler + Copy + Unpin>(
+    handler: H,
+    config: runners::single::SingleRunnerConfig,
+    thread_per_core: Option<runners::thread_per_core::ThreadPerCoreRunnerConfig>,
+    watch: Option<runners::watch::WatchConfig>,
+    user_code: UserCode,
+) -> BoxedDynRunner {
+    match (thread_per_core, watch) {
+        (Some(config), _) => Box::new(
+            runners::thread_per_core::ThreadPerCoreRunner::new_request_handler(
+                handler, config, user_code,
+            ),
+        ),
+        (None, Some(watch)) => Box::new(runners::watch::WatchRunner::new_request_handler(
+            handler, config, watch, user_code,
+        )),
+        (None, None) => Box::new(runners::single::SingleRunner::new_request_handler(
+            handler, config, user_code,
+        )),
+    }
+}
+
 /// winterjs CLI
 #[derive(clap::Parser, Debug)]
 #[clap(version)]
@@ -272,9 +394,68 @@ struct CmdServe {
     #[clap(long, default_value = "16", env = "WINTERJS_MAX_JS_THREADS")]
     max_js_threads: usize,
 
-    // /// Watch the Javascript file for changes and automatically reload.
-    // #[clap(short, long, env = "WINTERJS_WATCH")]
-    // watch: bool,
+    /// Amount of Javascript worker threads to start before accepting
+    /// requests. The server only starts listening once these threads have
+    /// loaded the user code, so the first requests don't pay for it.
+    #[clap(long, default_value = "0", env = "WINTERJS_MIN_JS_THREADS")]
+    min_js_threads: usize,
+
+    /// Start all Javascript worker threads before accepting requests.
+    /// Equivalent to setting --min-js-threads to --max-js-threads.
+    #[clap(long, env = "WINTERJS_PREWARM")]
+    prewarm: bool,
+
+    /// Maximum time a single request may spend running Javascript, in
+    /// milliseconds. Requests that go over it are terminated and answered
+    /// with a 504, without affecting other requests on the same thread.
+    #[clap(long, env = "WINTERJS_REQUEST_CPU_BUDGET_MS")]
+    request_cpu_budget_ms: Option<u64>,
+
+    /// Maximum time any single Javascript task, such as a promise callback
+    /// or timer, may run before being terminated, in milliseconds. Defaults
+    /// to --request-cpu-budget-ms.
+    #[clap(long, env = "WINTERJS_TASK_CPU_BUDGET_MS")]
+    task_cpu_budget_ms: Option<u64>,
+
+    /// How to pick the Javascript worker thread for each request.
+    #[clap(long, value_enum, default_value_t, env = "WINTERJS_BALANCING_POLICY")]
+    balancing_policy: runners::balancing::BalancingPolicy,
+
+    /// Replace Javascript worker threads after they have handled this many
+    /// requests. The replacement is started in the background, and the old
+    /// thread finishes its pending requests before quitting.
+    #[clap(long, env = "WINTERJS_RECYCLE_AFTER_REQUESTS")]
+    recycle_after_requests: Option<u64>,
+
+    /// Replace Javascript worker threads once their GC heap grows beyond
+    /// this many megabytes.
+    #[clap(long, env = "WINTERJS_RECYCLE_HEAP_MB")]
+    recycle_heap_mb: Option<u64>,
+
+    /// Maximum amount of requests that can be queued on a single Javascript
+    /// worker thread, including the ones it is currently processing. Once
+    /// all threads are at this limit, new requests are rejected with a 503.
+    #[clap(long, default_value = "1024", env = "WINTERJS_MAX_QUEUED_REQUESTS")]
+    max_queued_requests: usize,
+
+    /// Reject requests with a 503 if the estimated time they would spend
+    /// waiting for a Javascript worker thread exceeds this many milliseconds.
+    /// Disabled by default.
+    #[clap(long, env = "WINTERJS_MAX_QUEUE_WAIT_MS")]
+    max_queue_wait_ms: Option<u64>,
+
+    /// Watch the Javascript code for changes and automatically reload it.
+    /// The new code is started in the background, and only takes over once
+    /// it's ready to serve requests; requests that are already being
+    /// handled finish on the old code.
+    #[clap(
+        short,
+        long,
+        env = "WINTERJS_WATCH",
+        conflicts_with_all = ["single_threaded", "thread_per_core"]
+    )]
+    watch: bool,
+
     /// Path to a Javascript file to serve.
     #[clap(env = "WINTERJS_PATH")]
     js_path: PathBuf,
@@ -294,6 +475,44 @@ struct CmdServe {
     #[clap(long, env = "WINTERJS_SINGLE_THREADED")]
     single_threaded: bool,
 
+    /// Have every Javascript worker thread accept and serve its own
+    /// connections, instead of accepting connections on a shared pool of
+    /// threads and passing requests to the workers. Listeners are bound
+    /// with SO_REUSEPORT, so the kernel balances connections between the
+    /// workers. One worker is started per CPU core, up to --max-js-threads.
+    #[clap(
+        long,
+        env = "WINTERJS_THREAD_PER_CORE",
+        conflicts_with = "single_threaded"
+    )]
+    thread_per_core: bool,
+
+    /// Serve from this many processes, each with its own Javascript worker
+    /// threads, so a crash only takes down one of them. Crashed processes
+    /// are restarted. The processes listen on the same address with
+    /// SO_REUSEPORT, and the user code is compiled once and shared through
+    /// the code cache. Linux only.
+    #[clap(long, env = "WINTERJS_PROCESSES")]
+    processes: Option<usize>,
+
+    /// Directory to keep compiled Javascript code in. Processes that load
+    /// the same code later, e.g. after a restart, reuse the compiled code
+    /// instead of parsing it again.
+    #[clap(long, env = "WINTERJS_CODE_CACHE_DIR")]
+    code_cache_dir: Option<PathBuf>,
+
+    /// Cache responses in memory, up to this many megabytes, as allowed by
+    /// their Cache-Control headers, and answer later requests for them
+    /// without running any Javascript. Not used with --thread-per-core.
+    #[clap(long, env = "WINTERJS_HTTP_CACHE_MB")]
+    http_cache_mb: Option<usize>,
+
+    /// Write a JSON breakdown of where startup time went to this file,
+    /// once the server is listening and the Javascript workers started
+    /// before it are ready. Starts at least one worker up front.
+    #[clap(long, env = "WINTERJS_STARTUP_REPORT")]
+    startup_report: Option<PathBuf>,
+
     #[cfg(not(target_os = "wasi"))]
     /// Clean shutdown timeout, i.e. how long to wait before forcefully
     /// terminating request handler threads after Ctrl+C is pressed, in
@@ -314,6 +533,10 @@ struct CmdExec {
     /// be loaded in module mode instead.
     #[clap(short, long, env = "WINTERJS_SCRIPT")]
     script: bool,
+
+    /// Directory to keep compiled Javascript code in, see the serve command.
+    #[clap(long, env = "WINTERJS_CODE_CACHE_DIR")]
+    code_cache_dir: Option<PathBuf>,
 }
 
 #[derive(Debug, Clone, ValueEnum)]
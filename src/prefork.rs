@@ -0,0 +1,302 @@
+//! Serves from several processes instead of one, so a crash only takes down
+//! the process it happened in. The parent process forks the server
+//! processes and restarts them when they die; each of them binds its own
+//! listener with SO_REUSEPORT, and the kernel spreads connections between
+//! them.
+//!
+//! SpiderMonkey and tokio both start threads of their own, and a forked
+//! child only keeps the thread that called `fork`. The parent therefore
+//! never initializes either of them: it forks once to compile the user code
+//! into the code cache, and the server processes then load the compiled
+//! code from there instead of each compiling it again.
+//!
+//! The parent keeps SIGINT, SIGTERM and SIGCHLD blocked and waits for them
+//! with `sigtimedwait`, so a signal that arrives while it's busy stays
+//! pending until it gets around to it, instead of slipping in between a
+//! check and a blocking call.
+
+use std::{
+    path::PathBuf,
+    time::{Duration, Instant},
+};
+
+use anyhow::{bail, Context as _};
+
+use crate::{
+    builtins,
+    code_cache::{self, CodeKind},
+    request_handlers::UserCode,
+    sm_utils::JsApp,
+};
+
+// A process that dies sooner than this after starting is restarted with a
+// delay, so a script that fails on startup doesn't make us fork in a loop.
+const MIN_HEALTHY_UPTIME: Duration = Duration::from_secs(5);
+const RESTART_DELAY: Duration = Duration::from_secs(1);
+
+pub struct PreforkConfig {
+    pub processes: usize,
+    pub user_code: UserCode,
+    /// The code cache directory, if one was configured. Without one, a
+    /// temporary directory is used for as long as the parent is running.
+    pub code_cache_dir: Option<PathBuf>,
+}
+
+/// Where execution continues after [`run`] returns.
+pub enum Role {
+    /// The parent process, after all server processes have exited.
+    Parent,
+    /// A server process, which should go on to start the server.
+    Server { index: usize, user_code: UserCode },
+}
+
+/// Forks the server processes and supervises them until shutdown. Must be
+/// called before any threads are started.
+pub fn run(config: PreforkConfig) -> anyhow::Result<Role> {
+    if config.processes == 0 {
+        bail!("The number of processes must be at least 1");
+    }
+
+    let temp_cache_dir = match config.code_cache_dir {
+        Some(_) => None,
+        None => {
+            let dir =
+                std::env::temp_dir().join(format!("winterjs-code-cache-{}", std::process::id()));
+            code_cache::enable_disk_cache(&dir)?;
+            Some(dir)
+        }
+    };
+
+    let result = supervise(config.processes, &config.user_code);
+
+    if let (Some(dir), Ok(None) | Err(_)) = (temp_cache_dir, &result) {
+        _ = std::fs::remove_dir_all(dir);
+    }
+
+    Ok(match result? {
+        Some(index) => Role::Server {
+            index,
+            user_code: config.user_code,
+        },
+        None => Role::Parent,
+    })
+}
+
+struct ServerProcess {
+    pid: libc::pid_t,
+    started: Instant,
+}
+
+// Returns the index of the server process we're in, or None in the parent
+// once all server processes have exited.
+fn supervise(processes: usize, user_code: &UserCode) -> anyhow::Result<Option<usize>> {
+    precompile(user_code);
+
+    let signals = block_signals()?;
+
+    let mut children = Vec::with_capacity(processes);
+    for index in 0..processes {
+        match fork()? {
+            None => return Ok(Some(become_server(index, &signals))),
+            Some(pid) => children.push(Some(ServerProcess {
+                pid,
+                started: Instant::now(),
+            })),
+        }
+    }
+    tracing::info!("Started {processes} server processes");
+
+    let mut shutting_down = false;
+
+    while children.iter().any(Option::is_some) {
+        if is_shutdown_signal(wait_for_signal(&signals, None)) && !shutting_down {
+            shutting_down = true;
+            forward_shutdown(&children);
+        }
+
+        // Several exits can be reported by a single SIGCHLD, so reap
+        // everything that's there.
+        loop {
+            let mut status = 0;
+            let pid = unsafe { libc::waitpid(-1, &mut status, libc::WNOHANG) };
+            if pid <= 0 {
+                break;
+            }
+
+            let Some(index) = children
+                .iter()
+                .position(|c| c.as_ref().is_some_and(|c| c.pid == pid))
+            else {
+                continue;
+            };
+            let child = children[index].take().unwrap();
+
+            if shutting_down {
+                continue;
+            }
+
+            if libc::WIFSIGNALED(status) {
+                tracing::error!(
+                    "Server process #{index} was killed by signal {}, restarting it",
+                    libc::WTERMSIG(status)
+                );
+            } else {
+                tracing::error!(
+                    "Server process #{index} exited with status {}, restarting it",
+                    libc::WEXITSTATUS(status)
+                );
+            }
+
+            if child.started.elapsed() < MIN_HEALTHY_UPTIME
+                && sleep_unless_shutdown(&signals, RESTART_DELAY)
+            {
+                shutting_down = true;
+                forward_shutdown(&children);
+                continue;
+            }
+
+            match fork()? {
+                None => return Ok(Some(become_server(index, &signals))),
+                Some(pid) => {
+                    children[index] = Some(ServerProcess {
+                        pid,
+                        started: Instant::now(),
+                    })
+                }
+            }
+        }
+    }
+
+    Ok(None)
+}
+
+fn become_server(index: usize, signals: &libc::sigset_t) -> usize {
+    unsafe {
+        // Don't outlive the parent, which is the only one restarting us.
+        libc::prctl(libc::PR_SET_PDEATHSIG, libc::SIGTERM);
+        libc::pthread_sigmask(libc::SIG_UNBLOCK, signals, std::ptr::null_mut());
+    }
+
+    index
+}
+
+fn fork() -> anyhow::Result<Option<libc::pid_t>> {
+    match unsafe { libc::fork() } {
+        -1 => Err(std::io::Error::last_os_error()).context("Failed to fork server process"),
+        0 => Ok(None),
+        pid => Ok(Some(pid)),
+    }
+}
+
+// Compiles the user code in a short-lived child, so the results end up in
+// the code cache without the parent ever starting the engine.
+fn precompile(user_code: &UserCode) {
+    let pid = match fork() {
+        Ok(None) => {
+            let code = match compile_user_code(user_code) {
+                Ok(()) => 0,
+                Err(e) => {
+                    tracing::warn!(error = %e, "Failed to precompile user code");
+                    1
+                }
+            };
+            std::process::exit(code);
+        }
+        Ok(Some(pid)) => pid,
+        Err(e) => {
+            tracing::warn!(error = %e, "Failed to precompile user code");
+            return;
+        }
+    };
+
+    let mut status = 0;
+    unsafe { libc::waitpid(pid, &mut status, 0) };
+}
+
+fn compile_user_code(user_code: &UserCode) -> anyhow::Result<()> {
+    let app = JsApp::build::<runtime::module::Loader, builtins::Modules>(None, None);
+    let cx = app.cx();
+
+    match user_code {
+        UserCode::Script { code, file_name } => {
+            code_cache::get_or_compile(cx, CodeKind::Script, &file_name.to_string_lossy(), code)?;
+        }
+        // Compiled the way sm_utils::evaluate_module does it, so the server
+        // processes find it in the cache.
+        UserCode::Module(path) => {
+            let path_str = path.to_str().context("Script path is not valid UTF-8")?;
+            let file_name = path
+                .file_name()
+                .context("Failed to get file name from script path")?
+                .to_string_lossy();
+            let code = std::fs::read_to_string(path).context("Failed to read script file")?;
+            code_cache::get_or_compile_as(cx, CodeKind::Module, path_str, &file_name, &code)?;
+        }
+        // The modules making up the app are only known once it's loaded.
+        UserCode::Directory(_) => (),
+    }
+
+    Ok(())
+}
+
+// Blocks the signals the parent waits for, and returns them as a set.
+fn block_signals() -> anyhow::Result<libc::sigset_t> {
+    unsafe {
+        let mut signals: libc::sigset_t = std::mem::zeroed();
+        libc::sigemptyset(&mut signals);
+        for signal in [libc::SIGINT, libc::SIGTERM, libc::SIGCHLD] {
+            libc::sigaddset(&mut signals, signal);
+        }
+        match libc::pthread_sigmask(libc::SIG_BLOCK, &signals, std::ptr::null_mut()) {
+            0 => (),
+            e => {
+                return Err(std::io::Error::from_raw_os_error(e)).context("Failed to block signals")
+            }
+        }
+        Ok(signals)
+    }
+}
+
+// Waits for one of `signals`, or until the timeout passes. Returns the
+// signal, if there was one.
+fn wait_for_signal(signals: &libc::sigset_t, timeout: Option<Duration>) -> Option<libc::c_int> {
+    let timeout = timeout.map(|t| libc::timespec {
+        tv_sec: t.as_secs() as libc::time_t,
+        tv_nsec: t.subsec_nanos() as libc::c_long,
+    });
+    let timeout = timeout
+        .as_ref()
+        .map_or(std::ptr::null(), |t| t as *const libc::timespec);
+
+    let signal = unsafe { libc::sigtimedwait(signals, std::ptr::null_mut(), timeout) };
+    (signal > 0).then_some(signal)
+}
+
+fn is_shutdown_signal(signal: Option<libc::c_int>) -> bool {
+    matches!(signal, Some(libc::SIGINT | libc::SIGTERM))
+}
+
+// Sleeps for `delay`, unless a shutdown is requested in the meantime.
+// Returns whether it was.
+fn sleep_unless_shutdown(signals: &libc::sigset_t, delay: Duration) -> bool {
+    let deadline = Instant::now() + delay;
+    loop {
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        if remaining.is_zero() {
+            return false;
+        }
+        // Other children exiting wake us up too, but they're reaped once
+        // we're back in the loop.
+        if is_shutdown_signal(wait_for_signal(signals, Some(remaining))) {
+            return true;
+        }
+    }
+}
+
+// Server processes shut down cleanly on SIGINT, just like a single server
+// process would on Ctrl+C.
+fn forward_shutdown(children: &[Option<ServerProcess>]) {
+    for child in children.iter().flatten() {
+        unsafe { libc::kill(child.pid, libc::SIGINT) };
+    }
+}
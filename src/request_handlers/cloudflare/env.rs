@@ -8,7 +8,7 @@ use runtime::{
     promise::future_to_promise,
 };
 
-use crate::{ion_err, ion_mk_err};
+use crate::{ion_err, ion_mk_err, request_handlers::RequestBody};
 
 #[js_class]
 pub struct Env {
@@ -111,8 +111,8 @@ impl EnvAssets {
                             cx.await_native_cx(|cx| request_body.into_bytes(cx)).await;
                         let body_bytes = body_bytes?;
                         let body = match body_bytes {
-                            Some(bytes) => hyper::Body::from(bytes),
-                            None => hyper::Body::empty(),
+                            Some(bytes) => RequestBody::Buffered(bytes),
+                            None => RequestBody::Empty,
                         };
 
                         (cx, http_req.body(body)?)
@@ -122,7 +122,7 @@ impl EnvAssets {
                         http::Request::builder()
                             .uri(url)
                             .method(http::Method::GET)
-                            .body(hyper::Body::empty())?,
+                            .body(RequestBody::Empty)?,
                     ),
                 };
 
@@ -121,7 +121,7 @@ impl CloudflareRequestHandler {
     }
 
     async fn serve_static_file(req: Request) -> ion::Result<hyper::Response<hyper::Body>> {
-        let mut hyper_req = hyper::Request::from_parts(req.parts, req.body);
+        let mut hyper_req = hyper::Request::from_parts(req.parts, req.body.into_hyper_body());
         let response = Self::get_sws_request_handler()?
             .handle(&mut hyper_req, None)
             .await;
@@ -205,10 +205,10 @@ impl RequestHandler for CloudflareRequestHandler {
                 return Ok(Either::Left(PendingResponse {
                     promise: unsafe {
                         future_to_promise::<_, _, _, ion::Error>(&cx, move |cx| async move {
-                            let uri = super::build_request_uri(&request).map_err(|e| {
+                            let url = super::build_request_url(&request.parts).map_err(|e| {
                                 ion_mk_err!(format!("Failed to parse request URI: {e}"), Normal)
                             })?;
-                            let url = url::Url::parse(uri.to_string().as_str())?;
+                            let url = url::Url::parse(&url)?;
                             let (cx, response) =
                                 cx.await_native(Self::serve_static_file(request)).await;
                             let response = response.map_err(|e| {
@@ -357,6 +357,11 @@ fn build_response(cx: &Context, result: Object) -> Result<Either<PendingResponse
         Ok(Either::Left(PendingResponse {
             promise: unsafe { Promise::from_unchecked(result.into_local()) },
         }))
+    } else if let Some(response) = crate::builtins::static_response::lookup(cx, &result) {
+        Ok(Either::Right(ReadyResponse {
+            response,
+            body_future: None,
+        }))
     } else if FetchResponse::instance_of(cx, &result) {
         let response = FetchResponse::get_mut_private(cx, &result).unwrap();
         super::build_response_from_fetch_response(cx, response).map(Either::Right)
@@ -1,22 +1,22 @@
 use std::{ffi::OsString, path::PathBuf, pin::Pin};
 
 use anyhow::{anyhow, bail, Context as _, Result};
+use bytes::Bytes;
 use futures::Future;
-use http::Uri;
-use ion::{
-    function::Opt, string::byte::ByteString, ClassDefinition, Context, Object, TracedHeap, Value,
-};
+use hyper::body::HttpBody;
+use ion::{function::Opt, ClassDefinition, Context, Object, TracedHeap, Value};
 use mozjs::jsval::JSVal;
 use mozjs_sys::jsapi::JSObject;
 use runtime::{
     globals::fetch::{
-        hyper_body_to_stream, FetchBody, FetchBodyInner, HeaderEntry, HeadersInit,
-        Request as FetchRequest, RequestInfo, RequestInit,
+        hyper_body_to_stream, FetchBody, FetchBodyInner, Request as FetchRequest, RequestInfo,
+        RequestInit,
     },
     module::StandardModules,
 };
 
 pub mod cloudflare;
+pub mod request_signal;
 pub mod service_workers;
 pub mod wintercg;
 
@@ -57,7 +57,48 @@ impl UserCode {
 
 pub struct Request {
     pub parts: http::request::Parts,
-    pub body: hyper::Body,
+    pub body: RequestBody,
+}
+
+/// Bodies with a known length up to this size are read in full before the
+/// request is handed to a worker.
+const BUFFERED_BODY_LIMIT: u64 = 64 * 1024;
+
+/// Most requests have no body or a small one, which scripts can read
+/// without going through a ReadableStream.
+pub enum RequestBody {
+    Empty,
+    Buffered(Bytes),
+    Stream(hyper::Body),
+}
+
+impl RequestBody {
+    /// Reads small bodies, and leaves larger ones and those of unknown size
+    /// to be streamed.
+    pub async fn read(parts: &http::request::Parts, body: hyper::Body) -> Result<Self> {
+        if matches!(parts.method, http::Method::GET | http::Method::HEAD) {
+            return Ok(Self::Empty);
+        }
+
+        match body.size_hint().exact() {
+            Some(0) => Ok(Self::Empty),
+            Some(len) if len <= BUFFERED_BODY_LIMIT => {
+                let bytes = hyper::body::to_bytes(body)
+                    .await
+                    .context("Failed to read request body")?;
+                Ok(Self::Buffered(bytes))
+            }
+            _ => Ok(Self::Stream(body)),
+        }
+    }
+
+    pub fn into_hyper_body(self) -> hyper::Body {
+        match self {
+            Self::Empty => hyper::Body::empty(),
+            Self::Buffered(bytes) => hyper::Body::from(bytes),
+            Self::Stream(body) => body,
+        }
+    }
 }
 
 pub enum Either<A, B> {
@@ -168,65 +209,71 @@ impl StandardModules for Box<dyn ByRefStandardModules> {
     }
 }
 
-fn build_request_uri(request: &Request) -> Result<Uri> {
-    let host = get_host(&request.parts.uri, &request.parts.headers)?;
-    Uri::builder()
-        .scheme("http")
-        .authority(host)
-        .path_and_query(
-            request
-                .parts
-                .uri
-                .path_and_query()
-                .cloned()
-                .unwrap_or("/".parse().unwrap()),
-        )
-        .build()
-        .context("Failed to build request URI")
+// Builds the URL straight into a string, since that's what the Request
+// constructor takes. It gets parsed and validated there.
+fn build_request_url(parts: &http::request::Parts) -> Result<String> {
+    const SCHEME: &str = "http://";
+
+    let host = get_host(&parts.uri, &parts.headers)?;
+    // Anything that would end the authority part would let the Host header
+    // change the path the script sees.
+    if !host
+        .bytes()
+        .all(|b| b.is_ascii_graphic() && !matches!(b, b'/' | b'?' | b'#' | b'@' | b'\\'))
+    {
+        bail!("Invalid host '{host}'");
+    }
+    let path_and_query = parts.uri.path_and_query().map_or("/", |p| p.as_str());
+
+    let mut url = String::with_capacity(SCHEME.len() + host.len() + path_and_query.len());
+    url.push_str(SCHEME);
+    url.push_str(host);
+    url.push_str(path_and_query);
+    Ok(url)
 }
 
 fn build_fetch_request(cx: &Context, request: Request) -> Result<*mut JSObject> {
-    let uri = build_request_uri(&request)?;
-    tracing::debug!(%uri, "Computed request URI");
-
-    let body = match &request.parts.method {
-        &http::Method::GET | &http::Method::HEAD => hyper::Body::empty(),
-        _ => request.body,
+    let Request { parts, body } = request;
+
+    let url = build_request_url(&parts)?;
+    tracing::debug!(%url, "Computed request URL");
+
+    let body = match body {
+        RequestBody::Empty => None,
+        RequestBody::Buffered(bytes) => Some(FetchBodyInner::Bytes(bytes)),
+        RequestBody::Stream(body) => Some(FetchBodyInner::Stream(
+            hyper_body_to_stream(cx, body)
+                .ok_or_else(|| anyhow!("Failed to create ReadableStream for request body"))?,
+        )),
     };
 
-    let request_info = RequestInfo::String(uri.to_string());
-
-    let header_entries = request
-        .parts
-        .headers
-        .iter()
-        .map(|h| {
-            anyhow::Ok(HeaderEntry {
-                name: ByteString::from(h.0.to_string().into())
-                    .ok_or(anyhow!("Invalid characters in header name"))?,
-                value: ByteString::from(h.1.to_str().map(|x| x.to_string().into())?)
-                    .ok_or(anyhow!("Invalid characters in header value"))?,
-            })
-        })
-        .collect::<Result<_, _>>()?;
+    let request_info = RequestInfo::String(url);
+
+    let signal = request_signal::create(cx).unwrap_or_else(|e| {
+        tracing::warn!(error = %e, "Failed to set up request signal");
+        None
+    });
 
     let request_init = RequestInit {
-        method: Some(request.parts.method.to_string()),
-        headers: Some(HeadersInit::Array(header_entries)),
-        body: Some(FetchBody {
-            body: FetchBodyInner::Stream(
-                hyper_body_to_stream(cx, body)
-                    .ok_or_else(|| anyhow!("Failed to create ReadableStream for request body"))?,
-            ),
+        // GET is the default, and by far the most common method.
+        method: (parts.method != http::Method::GET).then(|| parts.method.as_str().to_owned()),
+        body: body.map(|body| FetchBody {
+            body,
             kind: None,
             source: None,
         }),
+        signal,
         ..Default::default()
     };
 
-    let request = FetchRequest::constructor(cx, request_info, Opt(Some(request_init)))
+    let mut request = FetchRequest::constructor(cx, request_info, Opt(Some(request_init)))
         .map_err(|e| anyhow!("Failed to construct request: {e:?}"))?;
 
+    // The Headers object keeps a native header map, and only creates JS
+    // strings for the entries scripts actually read. The incoming headers
+    // came from hyper, so they don't need to be validated again either.
+    *request.headers_mut(cx) = parts.headers;
+
     Ok(FetchRequest::new_object(cx, Box::new(request)))
 }
 
@@ -256,15 +303,27 @@ fn build_response_from_fetch_response(
 
     let headers =
         anyhow::Context::context(hyper_response.headers_mut(), "Response has no headers")?;
-    let response_headers = response.get_headers_object(cx);
-    for header in response_headers.iter() {
-        headers.append(header.0.clone(), header.1.clone());
-    }
+    // The script may still hold on to the response and read its headers,
+    // so we can't take them. Header names and values are backed by Bytes
+    // though, so cloning the whole map at once only allocates the map
+    // itself and shares every entry.
+    *headers = response.headers(cx).clone();
 
     let body = response
         .take_body()
         .map_err(|e| anyhow!("Failed to read response body: {e:?}"))?;
 
+    // Strings, buffers and blobs are already in memory, and can be sent
+    // as they are. Only streams need to be read on the JS thread. hyper
+    // sets the Content-Length from the body, except on responses that
+    // mustn't have one, like 204s, 304s and responses to HEAD requests.
+    if let FetchBodyInner::Bytes(bytes) = body.body {
+        return Ok(ReadyResponse {
+            response: hyper_response.body(hyper::Body::from(bytes))?,
+            body_future: None,
+        });
+    }
+
     let (body, future) = body
         .into_http_body(cx.duplicate())
         .map_err(|e| anyhow!("Failed to create HTTP body: {e:?}"))?;
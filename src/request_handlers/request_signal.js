@@ -0,0 +1,17 @@
+// Creates and aborts the controllers behind the signals of requests that
+// come in from clients. Evaluated once per worker; the runtime keeps the
+// functions in the completion value.
+
+(function () {
+  return {
+    controller() {
+      return new AbortController();
+    },
+
+    abort(controller) {
+      const reason = new Error("The client closed the connection");
+      reason.name = "AbortError";
+      controller.abort(reason);
+    },
+  };
+})();
@@ -0,0 +1,128 @@
+//! Aborts the `signal` of incoming requests once their client disconnects,
+//! so scripts can stop work nobody is waiting for any more, e.g. by passing
+//! `request.signal` on to `fetch`.
+//!
+//! The runner creates a [`RequestSignal`] for each request and starts the
+//! request with [`with_signal`]; `build_fetch_request` then creates an
+//! `AbortController` for it and passes the controller's signal to the
+//! native `Request` constructor, like a script would with `init.signal`.
+
+use std::{cell::RefCell, rc::Rc};
+
+use anyhow::{anyhow, bail, Context as _, Result};
+use ion::{Context, Function, Object, PermanentHeap, TracedHeap, Value};
+use mozjs_sys::jsapi::{JSFunction, JSObject};
+
+use crate::sm_utils;
+
+const HELPERS_SCRIPT: &str = include_str!("request_signal.js");
+
+struct Helpers {
+    controller: PermanentHeap<*mut JSFunction>,
+    abort: PermanentHeap<*mut JSFunction>,
+}
+
+thread_local! {
+    static HELPERS: RefCell<Option<Rc<Helpers>>> = RefCell::new(None);
+
+    // The signal of the request that is currently being started.
+    static STARTING: RefCell<Option<RequestSignal>> = RefCell::new(None);
+}
+
+/// Handle to the signal of an incoming request.
+#[derive(Clone, Default)]
+pub struct RequestSignal {
+    controller: Rc<RefCell<Option<TracedHeap<*mut JSObject>>>>,
+}
+
+impl RequestSignal {
+    /// Aborts the request's signal. Does nothing if the request object was
+    /// never created, or if the signal was already aborted.
+    pub fn abort(&self, cx: &Context) {
+        let Some(controller) = self.controller.borrow_mut().take() else {
+            return;
+        };
+
+        let controller = Value::object(cx, &controller.root(cx).into());
+        if let Err(e) = call_helper(cx, |h| &h.abort, &[controller]) {
+            tracing::warn!(error = %e, "Failed to abort request signal");
+        }
+    }
+}
+
+/// Runs `f`, which starts handling a request, with `signal` as the signal of
+/// the request object it creates.
+pub fn with_signal<T>(signal: &RequestSignal, f: impl FnOnce() -> T) -> T {
+    STARTING.with(|s| *s.borrow_mut() = Some(signal.clone()));
+    let result = f();
+    STARTING.with(|s| *s.borrow_mut() = None);
+    result
+}
+
+/// Creates the signal for the request being started, if there is one.
+pub(super) fn create(cx: &Context) -> Result<Option<*mut JSObject>> {
+    let Some(signal) = STARTING.with(|s| s.borrow_mut().take()) else {
+        return Ok(None);
+    };
+
+    let controller = call_helper(cx, |h| &h.controller, &[])?;
+    if !controller.handle().is_object() {
+        bail!("Request signal helper did not return an AbortController");
+    }
+    let controller = controller.to_object(cx);
+    let abort_signal = controller
+        .get(cx, "signal")
+        .ok()
+        .flatten()
+        .filter(|s| s.handle().is_object())
+        .ok_or_else(|| anyhow!("AbortController has no signal"))?
+        .handle()
+        .to_object();
+
+    *signal.controller.borrow_mut() = Some(TracedHeap::new(controller.handle().get()));
+    Ok(Some(abort_signal))
+}
+
+fn call_helper<'cx>(
+    cx: &'cx Context,
+    which: impl FnOnce(&Helpers) -> &PermanentHeap<*mut JSFunction>,
+    args: &[Value],
+) -> Result<Value<'cx>> {
+    let helpers = match HELPERS.with(|h| h.borrow().clone()) {
+        Some(helpers) => helpers,
+        None => {
+            let helpers = Rc::new(load_helpers(cx)?);
+            HELPERS.with(|h| *h.borrow_mut() = Some(helpers.clone()));
+            helpers
+        }
+    };
+
+    Function::from(which(&helpers).root(cx))
+        .call(cx, &Object::null(cx), args)
+        .map_err(|e| anyhow!("Request signal helper failed: {e:?}"))
+}
+
+fn load_helpers(cx: &Context) -> Result<Helpers> {
+    let helpers = sm_utils::evaluate_script(cx, HELPERS_SCRIPT, "request_signal.js")
+        .context("Failed to evaluate request signal helpers")?;
+    if !helpers.handle().is_object() {
+        bail!("Request signal helpers did not evaluate to an object");
+    }
+    let helpers = helpers.to_object(cx);
+
+    let function = |name: &str| {
+        helpers
+            .get(cx, name)
+            .ok()
+            .flatten()
+            .filter(|f| f.handle().is_object())
+            .and_then(|f| Function::from_object(cx, &f.to_object(cx)))
+            .map(|f| PermanentHeap::from_local(&f))
+            .ok_or_else(|| anyhow!("Request signal helper '{name}' is not a function"))
+    };
+
+    Ok(Helpers {
+        controller: function("controller")?,
+        abort: function("abort")?,
+    })
+}
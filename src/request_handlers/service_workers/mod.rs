@@ -58,6 +58,13 @@ pub fn build_response(cx: &Context, value: Object) -> anyhow::Result<ReadyRespon
         bail!("Script error: value provided to respondWith must be an instance of Response");
     }
 
+    if let Some(response) = crate::builtins::static_response::lookup(cx, &value) {
+        return Ok(ReadyResponse {
+            response,
+            body_future: None,
+        });
+    }
+
     let response = runtime::globals::fetch::Response::get_mut_private(cx, &value).unwrap();
 
     super::build_response_from_fetch_response(cx, response)
@@ -0,0 +1,244 @@
+//! Admission control for the JS worker queues. Every worker has a bounded
+//! queue, and requests that would overflow it, or that we expect to wait
+//! too long before a worker gets to them, are rejected early with a 503
+//! instead of piling up in memory.
+
+use std::{
+    sync::{
+        atomic::{AtomicI32, AtomicU64, AtomicUsize, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+pub const DEFAULT_MAX_QUEUED_REQUESTS: usize = 1024;
+
+#[derive(Clone, Debug)]
+pub struct AdmissionConfig {
+    /// Maximum number of requests that can be waiting in a single worker's
+    /// queue, or in flight in it.
+    pub max_queued_requests: usize,
+
+    /// Requests are rejected if the estimated time they'd have to wait for
+    /// their worker exceeds this.
+    pub max_queue_wait: Option<Duration>,
+}
+
+impl Default for AdmissionConfig {
+    fn default() -> Self {
+        Self {
+            max_queued_requests: DEFAULT_MAX_QUEUED_REQUESTS,
+            max_queue_wait: None,
+        }
+    }
+}
+
+impl AdmissionConfig {
+    /// Every request reserves its place in the channel before it's sent,
+    /// so sending never fails because the channel is full.
+    pub(super) fn channel_capacity(&self) -> usize {
+        self.max_queued_requests
+    }
+}
+
+/// Load statistics of a single worker, shared between the worker's slot and
+/// the requests sent to it.
+#[derive(Default)]
+pub struct WorkerLoad {
+    in_flight_requests: AtomicI32,
+
+    // Requests that were admitted but not yet taken off the worker's
+    // channel. Unlike the in-flight count, this includes requests whose
+    // client has gone away, since they still take up room in the channel.
+    queued_requests: AtomicUsize,
+
+    // Both averages are updated with a plain load and store rather than a
+    // CAS loop. Concurrent updates may lose a sample, which is fine for an
+    // estimate.
+    ewma_latency_us: AtomicU64,
+    // Fixed point, with CONCURRENCY_SCALE as the unit.
+    ewma_concurrency: AtomicU64,
+}
+
+const CONCURRENCY_SCALE: u64 = 256;
+
+fn ewma_update(avg: &AtomicU64, sample: u64) {
+    let old = avg.load(Ordering::Relaxed);
+    let new = if old == 0 {
+        sample
+    } else {
+        old - old / 8 + sample / 8
+    };
+    avg.store(new, Ordering::Relaxed);
+}
+
+impl WorkerLoad {
+    // The counters are only used as estimates, so they don't need to be
+    // ordered with respect to anything else.
+    pub fn in_flight_requests(&self) -> i32 {
+        self.in_flight_requests.load(Ordering::Relaxed)
+    }
+
+    /// Average time from dispatching a request to this worker until its
+    /// response is ready, or zero if no request has finished yet.
+    pub fn average_latency_us(&self) -> u64 {
+        self.ewma_latency_us.load(Ordering::Relaxed)
+    }
+
+    /// Estimates how long a new request would wait for this worker. Since
+    /// workers process many requests concurrently, this is based on Little's
+    /// law: the worker completes requests at roughly `concurrency / latency`,
+    /// so the requests already in flight take `in_flight * latency /
+    /// concurrency` to clear.
+    pub fn estimated_wait(&self) -> Duration {
+        let in_flight = self.in_flight_requests().max(0) as u64;
+        if in_flight == 0 {
+            return Duration::ZERO;
+        }
+
+        let latency_us = self.average_latency_us();
+        let concurrency = self
+            .ewma_concurrency
+            .load(Ordering::Relaxed)
+            .max(CONCURRENCY_SCALE);
+        Duration::from_micros(
+            latency_us.saturating_mul(in_flight * CONCURRENCY_SCALE) / concurrency,
+        )
+    }
+
+    pub fn start_request(self: &Arc<Self>) -> InFlightGuard {
+        let in_flight = self.in_flight_requests.fetch_add(1, Ordering::Relaxed) + 1;
+        ewma_update(
+            &self.ewma_concurrency,
+            in_flight.max(1) as u64 * CONCURRENCY_SCALE,
+        );
+        InFlightGuard {
+            load: self.clone(),
+            started: Instant::now(),
+        }
+    }
+}
+
+/// A place in a worker's request channel, reserved when the request is
+/// admitted. The worker releases it by dropping it when it takes the request
+/// off the channel.
+pub struct QueueSlot {
+    load: Arc<WorkerLoad>,
+}
+
+impl Drop for QueueSlot {
+    fn drop(&mut self) {
+        self.load.queued_requests.fetch_sub(1, Ordering::AcqRel);
+    }
+}
+
+/// Counts a request as in flight on its worker until dropped, and records
+/// the request's latency when it finishes.
+pub struct InFlightGuard {
+    load: Arc<WorkerLoad>,
+    started: Instant,
+}
+
+impl Drop for InFlightGuard {
+    fn drop(&mut self) {
+        ewma_update(
+            &self.load.ewma_latency_us,
+            self.started.elapsed().as_micros() as u64,
+        );
+        self.load.in_flight_requests.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug)]
+pub struct Rejection {
+    reason: &'static str,
+    retry_after: Duration,
+}
+
+impl Rejection {
+    pub fn queue_full() -> Self {
+        Self {
+            reason: "worker queue is full",
+            retry_after: Duration::from_secs(1),
+        }
+    }
+}
+
+pub struct AdmissionController {
+    config: AdmissionConfig,
+    shed_requests: AtomicU64,
+}
+
+impl AdmissionController {
+    pub fn new(config: AdmissionConfig) -> Self {
+        if config.max_queued_requests == 0 {
+            panic!("max_queued_requests must be at least 1");
+        }
+
+        Self {
+            config,
+            shed_requests: AtomicU64::new(0),
+        }
+    }
+
+    pub fn config(&self) -> &AdmissionConfig {
+        &self.config
+    }
+
+    /// Decides whether a request can be queued on the given worker, and
+    /// reserves its place in the worker's channel if so. This only looks at
+    /// one worker: runners that can send the request elsewhere should try
+    /// their other workers before rejecting it.
+    pub fn check(&self, load: &Arc<WorkerLoad>) -> Result<QueueSlot, Rejection> {
+        let max = self.config.max_queued_requests;
+
+        // Always let requests through to idle workers, otherwise a stale
+        // latency estimate could keep us rejecting forever.
+        let in_flight = load.in_flight_requests();
+        if in_flight > 0 {
+            if in_flight as usize >= max {
+                return Err(Rejection::queue_full());
+            }
+
+            if let Some(max_wait) = self.config.max_queue_wait {
+                let wait = load.estimated_wait();
+                if wait > max_wait {
+                    return Err(Rejection {
+                        reason: "estimated queue wait time is too long",
+                        retry_after: wait,
+                    });
+                }
+            }
+        }
+
+        load.queued_requests
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |queued| {
+                (queued < max).then_some(queued + 1)
+            })
+            .map_err(|_| Rejection::queue_full())?;
+        Ok(QueueSlot { load: load.clone() })
+    }
+
+    /// Records the rejection and builds the response to send back.
+    pub fn reject(&self, rejection: Rejection) -> hyper::Response<hyper::Body> {
+        let shed = self.shed_requests.fetch_add(1, Ordering::Relaxed) + 1;
+        tracing::debug!(reason = rejection.reason, "Shedding request");
+        if shed == 1 || shed % 1000 == 0 {
+            tracing::warn!(
+                "Server is overloaded, {shed} requests have been shed so far ({})",
+                rejection.reason
+            );
+        }
+
+        let retry_after = rejection.retry_after.as_secs_f64().ceil().max(1.0) as u64;
+        hyper::Response::builder()
+            .status(503)
+            .header(http::header::RETRY_AFTER, retry_after)
+            .body(hyper::Body::from("Server is overloaded"))
+            .expect("Failed to construct 503 response")
+    }
+
+    pub fn shed_requests(&self) -> u64 {
+        self.shed_requests.load(Ordering::Relaxed)
+    }
+}
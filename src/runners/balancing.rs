@@ -0,0 +1,135 @@
+//! Policies for picking the worker that should handle the next request.
+//! All of them only look at the workers that are already running; the
+//! runner decides separately whether to spawn a new one instead. Workers
+//! that are unavailable, because they failed and haven't been replaced yet,
+//! are only picked if no other worker is available.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use rand::Rng;
+
+use super::single::WorkerSlot;
+
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, clap::ValueEnum)]
+pub enum BalancingPolicy {
+    /// Use the first idle worker, or the one with the fewest in-flight
+    /// requests.
+    #[default]
+    LeastRequests,
+
+    /// Sample two workers at random and use the one with fewer in-flight
+    /// requests. Costs the same no matter how many workers there are, and
+    /// doesn't send every request to the same worker when many of them look
+    /// equally loaded.
+    PowerOfTwoChoices,
+
+    /// Use the worker with the least outstanding work, estimated as its
+    /// in-flight requests times its average request latency. Workers that
+    /// are stuck on slow requests get fewer new ones, even if they have the
+    /// same number of requests in flight as the others.
+    LeastWork,
+
+    /// Use every worker in turn, regardless of its load.
+    RoundRobin,
+}
+
+pub(super) struct Balancer {
+    policy: BalancingPolicy,
+    next: AtomicUsize,
+}
+
+impl Balancer {
+    pub(super) fn new(policy: BalancingPolicy) -> Self {
+        Self {
+            policy,
+            next: AtomicUsize::new(0),
+        }
+    }
+
+    /// Returns the index of the worker to use. `workers` must not be empty.
+    pub(super) fn pick(&self, workers: &[WorkerSlot]) -> usize {
+        let count = workers.len();
+        debug_assert!(count > 0);
+        if count == 1 {
+            return 0;
+        }
+
+        let picked = self.pick_by_policy(workers);
+        if workers[picked].is_available() {
+            return picked;
+        }
+
+        (1..count)
+            .map(|offset| (picked + offset) % count)
+            .find(|idx| workers[*idx].is_available())
+            .unwrap_or(picked)
+    }
+
+    fn pick_by_policy(&self, workers: &[WorkerSlot]) -> usize {
+        let count = workers.len();
+        match self.policy {
+            BalancingPolicy::LeastRequests => {
+                let mut best = (0, i32::MAX);
+                for (idx, worker) in workers.iter().enumerate() {
+                    if !worker.is_available() {
+                        continue;
+                    }
+                    let in_flight = worker.load.in_flight_requests();
+                    if in_flight <= 0 {
+                        return idx;
+                    }
+                    if in_flight < best.1 {
+                        best = (idx, in_flight);
+                    }
+                }
+                best.0
+            }
+
+            BalancingPolicy::PowerOfTwoChoices => {
+                let mut rng = rand::thread_rng();
+                let first = rng.gen_range(0..count);
+                // Pick the second one from the remaining workers, so we
+                // always compare two different ones.
+                let second = (first + rng.gen_range(1..count)) % count;
+                if workers[second].load.in_flight_requests()
+                    < workers[first].load.in_flight_requests()
+                {
+                    second
+                } else {
+                    first
+                }
+            }
+
+            BalancingPolicy::LeastWork => {
+                // Workers that haven't finished a request yet have no latency
+                // estimate. Assume they're average, rather than free, or
+                // they'd get every request until their first one completes.
+                let (total, known) = workers
+                    .iter()
+                    .filter(|w| w.is_available())
+                    .map(|w| w.load.average_latency_us())
+                    .filter(|l| *l > 0)
+                    .fold((0u64, 0u64), |(total, known), l| (total + l, known + 1));
+                let default_latency = if known > 0 { total / known } else { 1 };
+
+                workers
+                    .iter()
+                    .enumerate()
+                    .filter(|(_, w)| w.is_available())
+                    .min_by_key(|(_, w)| {
+                        let latency = match w.load.average_latency_us() {
+                            0 => default_latency,
+                            l => l,
+                        };
+                        // Count the new request too, so idle workers are
+                        // still compared by their latency.
+                        (w.load.in_flight_requests().max(0) as u64 + 1).saturating_mul(latency)
+                    })
+                    .map(|(idx, _)| idx)
+                    .unwrap_or(0)
+            }
+
+            BalancingPolicy::RoundRobin => self.next.fetch_add(1, Ordering::Relaxed) % count,
+        }
+    }
+}
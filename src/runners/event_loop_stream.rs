@@ -1,5 +1,6 @@
 use std::{
     pin::Pin,
+    rc::Rc,
     task::{self, Poll},
 };
 
@@ -7,10 +8,13 @@ use ion::ErrorReport;
 
 use crate::sm_utils::JsApp;
 
+use super::watchdog::CpuWatch;
+
 /// This stream keeps stepping the event loop of its runtime, generating a
 /// value whenever the event loop is empty, but never finishing.
 pub struct EventLoopStream<'app> {
     pub(super) app: &'app JsApp,
+    pub(super) cpu_watch: Option<Rc<CpuWatch>>,
 }
 
 impl<'app> futures::Stream for EventLoopStream<'app> {
@@ -19,7 +23,11 @@ impl<'app> futures::Stream for EventLoopStream<'app> {
     fn poll_next(self: Pin<&mut Self>, wcx: &mut task::Context<'_>) -> Poll<Option<Self::Item>> {
         let rt = self.app.rt();
         let event_loop_was_empty = rt.event_loop_is_empty();
-        match rt.step_event_loop(wcx) {
+        let result = match &self.cpu_watch {
+            Some(watch) => watch.run_task(|| rt.step_event_loop(wcx)),
+            None => rt.step_event_loop(wcx),
+        };
+        match result {
             Err(e) => Poll::Ready(Some(Err(e))),
             Ok(()) if rt.event_loop_is_empty() && !event_loop_was_empty => {
                 Poll::Ready(Some(Ok(())))
@@ -9,7 +9,8 @@ use crate::{
 };
 
 async fn exec_script_inner(path: impl AsRef<Path>, script_mode: bool) -> Result<()> {
-    let module_loader = (!script_mode).then(runtime::module::Loader::default);
+    let module_loader = (!script_mode)
+        .then(|| builtins::internal_js_modules::Loader::new(runtime::module::Loader::default()));
     let standard_modules = builtins::Modules {
         include_internal: !script_mode,
         hardware_concurrency: 1,
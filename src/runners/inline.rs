@@ -15,16 +15,23 @@ use async_trait::async_trait;
 use futures::Future;
 use tokio::sync::mpsc;
 
-use crate::request_handlers::{RequestHandler, UserCode};
+use crate::request_handlers::{RequestBody, RequestHandler, UserCode};
 
 use super::{
-    request_loop::{handle_requests, ControlMessage, RequestData},
+    admission::{AdmissionConfig, AdmissionController, Rejection},
+    request_loop::{
+        advance_lifecycle, handle_requests, lifecycle, shared_receiver, ControlMessage, Lifecycle,
+        LifecycleSender, RequestData, WorkerOptions,
+    },
+    watchdog::{self, CpuBudget},
     ResponseData,
 };
 
 #[derive(Clone)]
 pub struct InlineRunner {
-    channel: mpsc::UnboundedSender<ControlMessage>,
+    channel: mpsc::Sender<ControlMessage>,
+    lifecycle: Arc<LifecycleSender>,
+    admission: Arc<AdmissionController>,
     finished: Arc<AtomicBool>,
 }
 
@@ -36,15 +43,31 @@ impl InlineRunner {
     pub fn new_request_handler(
         handler: impl RequestHandler + Copy + Unpin,
         user_code: UserCode,
+        admission: AdmissionConfig,
+        cpu_budget: CpuBudget,
     ) -> (Self, impl InlineRunnerRequestHandlerFuture) {
-        let (tx, rx) = mpsc::unbounded_channel();
+        let admission = AdmissionController::new(admission);
+        let (tx, rx) = mpsc::channel(admission.config().channel_capacity());
+        let (lifecycle_tx, lifecycle_rx) = lifecycle();
         let this = Self {
             channel: tx,
+            lifecycle: Arc::new(lifecycle_tx),
+            admission: Arc::new(admission),
             finished: Arc::new(AtomicBool::new(false)),
         };
         let finished_clone = this.finished.clone();
         let fut = async move {
-            handle_requests(handler, user_code, rx, 1).await;
+            handle_requests(
+                handler,
+                user_code,
+                shared_receiver(rx),
+                1,
+                WorkerOptions {
+                    cpu_budget,
+                    ..WorkerOptions::new(None, lifecycle_rx)
+                },
+            )
+            .await;
             // Remember, we're running single-threaded, so no need
             // for any specific ordering logic.
             finished_clone.store(true, Ordering::Relaxed);
@@ -61,12 +84,29 @@ impl crate::server::Runner for InlineRunner {
         req: http::request::Parts,
         body: hyper::Body,
     ) -> Result<hyper::Response<hyper::Body>, anyhow::Error> {
+        let body = RequestBody::read(&req, body).await?;
         let (tx, rx) = tokio::sync::oneshot::channel();
 
-        self.channel.send(ControlMessage::HandleRequest(
-            RequestData { _addr, req, body },
+        // There is only one worker here, and the request loop moves requests
+        // out of the channel as soon as it can, so a full channel is the only
+        // overload signal we get.
+        match self.channel.try_send(ControlMessage::HandleRequest(
+            RequestData {
+                _addr,
+                req,
+                body,
+                queue_slot: None,
+            },
             tx,
-        ))?;
+        )) {
+            Ok(()) => (),
+            Err(mpsc::error::TrySendError::Full(_)) => {
+                return Ok(self.admission.reject(Rejection::queue_full()));
+            }
+            Err(mpsc::error::TrySendError::Closed(_)) => {
+                return Err(anyhow!("Request handler is not running"));
+            }
+        }
 
         let response = rx.await?;
 
@@ -86,10 +126,11 @@ impl crate::server::Runner for InlineRunner {
     async fn shutdown(&self, timeout: Option<Duration>) {
         tracing::info!("Shutting down...");
 
-        if self.channel.send(ControlMessage::Shutdown).is_err() {
-            // Channel already closed, future must have run to completion
+        if self.finished.load(Ordering::Relaxed) {
+            // The request loop already ran to completion
             return;
         }
+        advance_lifecycle(&self.lifecycle, Lifecycle::ShuttingDown);
 
         let shutdown_started = Instant::now();
 
@@ -101,7 +142,7 @@ impl crate::server::Runner for InlineRunner {
                             "Clean shutdown timeout was reached before all \
                             requests could finish processing"
                         );
-                        let _ = self.channel.send(ControlMessage::Terminate);
+                        advance_lifecycle(&self.lifecycle, Lifecycle::Terminating);
                         break;
                     }
                 }
@@ -113,6 +154,8 @@ impl crate::server::Runner for InlineRunner {
             }
         }
 
+        watchdog::log_violations();
+
         tracing::info!(
             "Shutdown completed in {} seconds",
             shutdown_started.elapsed().as_secs()
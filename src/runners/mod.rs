@@ -1,10 +1,17 @@
+pub mod admission;
+pub mod balancing;
 mod event_loop_stream;
 pub mod exec;
 pub mod inline;
 mod request_loop;
 mod request_queue;
 pub mod single;
+mod supervisor;
+pub mod thread_per_core;
 pub mod watch;
+pub mod watchdog;
+
+pub use request_loop::RecyclePolicy;
 
 #[derive(Debug)]
 pub enum ResponseData {
@@ -1,86 +1,290 @@
+use std::{rc::Rc, sync::Arc, task::Poll, time::Instant};
+
 use anyhow::anyhow;
 use futures::StreamExt;
 use ion::{Context, TracedHeap};
-use mozjs::{jsapi::JSContext, jsval::JSVal};
-use tokio::{select, sync::oneshot};
+use mozjs::{
+    jsapi::{JSContext, JSGCParamKey, JS_GetGCParameter},
+    jsval::JSVal,
+};
+use tokio::{
+    select,
+    sync::{mpsc, oneshot, watch},
+};
 
 use crate::{
     builtins,
-    request_handlers::{Either, Request, RequestHandler, UserCode},
+    request_handlers::{
+        request_signal::{self, RequestSignal},
+        Either, Request, RequestBody, RequestHandler, UserCode,
+    },
     runners::ResponseData,
     sm_utils::{error_report_option_to_anyhow_error, JsApp, TwoStandardModules},
+    startup::{self, Phase},
 };
 
 use super::{
+    admission::QueueSlot,
     event_loop_stream::EventLoopStream,
     request_queue::{RequestFinishedHandler, RequestFinishedResult, RequestQueue},
+    watchdog::{budget_exceeded_response, CpuBudget, CpuWatch, RequestCpu},
 };
 
 pub struct RequestData {
     pub(super) _addr: std::net::SocketAddr,
     pub(super) req: http::request::Parts,
-    pub(super) body: hyper::Body,
+    pub(super) body: RequestBody,
+    /// Released as soon as the worker takes the request off its channel.
+    pub(super) queue_slot: Option<QueueSlot>,
 }
 
 pub enum ControlMessage {
     HandleRequest(RequestData, tokio::sync::oneshot::Sender<ResponseData>),
-    Shutdown,
-    Terminate,
 }
 
 impl std::fmt::Debug for ControlMessage {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         match self {
             Self::HandleRequest(_, _) => write!(f, "HandleRequest"),
-            Self::Shutdown => write!(f, "Shutdown"),
-            Self::Terminate => write!(f, "Terminate"),
         }
     }
 }
 
+/// Tells workers to shut down. Request channels are bounded, so this is
+/// sent out of band, where it can't be held up by a full channel.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Lifecycle {
+    Running,
+    /// Handle the requests that are already queued, then quit.
+    ShuttingDown,
+    /// Cancel everything and quit right away.
+    Terminating,
+}
+
+pub(super) type LifecycleSender = watch::Sender<Lifecycle>;
+pub(super) type LifecycleReceiver = watch::Receiver<Lifecycle>;
+
+pub(super) fn lifecycle() -> (LifecycleSender, LifecycleReceiver) {
+    watch::channel(Lifecycle::Running)
+}
+
+/// Moves the workers on to `to`, unless they're already further along.
+pub(super) fn advance_lifecycle(sender: &LifecycleSender, to: Lifecycle) {
+    sender.send_if_modified(|current| {
+        let advance = *current < to;
+        if advance {
+            *current = to;
+        }
+        advance
+    });
+}
+
+// Waits until the lifecycle changes, or forever once the runner is gone.
+async fn lifecycle_changed(lifecycle: &mut LifecycleReceiver) -> Lifecycle {
+    if lifecycle.changed().await.is_err() {
+        // The runner was dropped without shutting us down, which only
+        // happens when the whole process is going away.
+        return std::future::pending().await;
+    }
+    *lifecycle.borrow_and_update()
+}
+
 // Used to ignore errors when sending responses back, since
 // if the receiving end of the oneshot channel is dropped,
 // there really isn't anything we can do
 fn ignore_error<E>(_r: std::result::Result<(), E>) {}
 
+/// Notified once the worker has finished evaluating the user code and is
+/// ready to accept requests, or with the error that prevented it.
+pub(super) type WorkerReadySender = oneshot::Sender<Result<(), anyhow::Error>>;
+
+/// A worker's request channel. Only one worker reads from it at a time, but
+/// when a worker is replaced, the old and new workers share it until the
+/// new one is ready to take over.
+pub(super) type SharedReceiver = Arc<tokio::sync::Mutex<mpsc::Receiver<ControlMessage>>>;
+
+pub(super) fn shared_receiver(recv: mpsc::Receiver<ControlMessage>) -> SharedReceiver {
+    Arc::new(tokio::sync::Mutex::new(recv))
+}
+
+/// The generation of the newest worker that is ready to read a shared
+/// channel. A worker that is ready to take over publishes its generation
+/// here; whichever older worker is reading the channel stops doing so,
+/// finishes the requests it already has and quits. This can't go through
+/// the channel itself, since nobody may be reading it.
+pub(super) type ChannelOwner = Arc<watch::Sender<u64>>;
+
+// Waits until a newer worker owns the channel, or forever if the channel
+// isn't shared.
+async fn handed_over(owner: &mut Option<watch::Receiver<u64>>, generation: u64) {
+    let Some(owner) = owner else {
+        return std::future::pending().await;
+    };
+    if owner.wait_for(|owner| *owner > generation).await.is_err() {
+        std::future::pending().await
+    }
+}
+
+pub(super) enum WorkerEvent {
+    /// The user code was evaluated and the worker is reading requests.
+    Ready,
+    /// Evaluating the user code failed.
+    Failed(anyhow::Error),
+    /// The worker reached its recycling limits and should be replaced.
+    Recycle,
+}
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct RecyclePolicy {
+    /// Replace workers after they have handled this many requests.
+    pub max_requests: Option<u64>,
+    /// Replace workers once their GC heap grows beyond this many bytes.
+    pub max_heap_bytes: Option<u64>,
+}
+
+impl RecyclePolicy {
+    fn should_recycle(&self, cx: &Context, handled_requests: u64) -> bool {
+        if let Some(max_requests) = self.max_requests {
+            if handled_requests >= max_requests {
+                return true;
+            }
+        }
+
+        if let Some(max_heap_bytes) = self.max_heap_bytes {
+            let heap_bytes = unsafe { JS_GetGCParameter(cx.as_ptr(), JSGCParamKey::JSGC_BYTES) };
+            if heap_bytes as u64 >= max_heap_bytes {
+                return true;
+            }
+        }
+
+        false
+    }
+}
+
+pub(super) struct WorkerOptions {
+    /// Distinguishes this worker from others that read the same channel.
+    pub generation: u64,
+
+    /// Set when the channel may already be read by another worker, which
+    /// we take over from once we're ready to handle requests. If we fail to
+    /// start, the other worker is left alone.
+    pub take_over: bool,
+
+    /// Set when the channel is shared between workers.
+    pub owner: Option<ChannelOwner>,
+
+    pub lifecycle: LifecycleReceiver,
+
+    pub recycle: RecyclePolicy,
+
+    pub cpu_budget: CpuBudget,
+
+    pub events: Box<dyn FnMut(WorkerEvent) + Send>,
+}
+
+impl WorkerOptions {
+    /// Options for a worker that owns its channel for its whole lifetime.
+    pub fn new(ready: Option<WorkerReadySender>, lifecycle: LifecycleReceiver) -> Self {
+        let mut ready = ready;
+        Self {
+            generation: 0,
+            take_over: false,
+            owner: None,
+            lifecycle,
+            recycle: Default::default(),
+            cpu_budget: Default::default(),
+            events: Box::new(move |event| match event {
+                WorkerEvent::Ready => {
+                    if let Some(ready) = ready.take() {
+                        ignore_error(ready.send(Ok(())));
+                    }
+                }
+                WorkerEvent::Failed(e) => {
+                    if let Some(ready) = ready.take() {
+                        ignore_error(ready.send(Err(e)));
+                    }
+                }
+                WorkerEvent::Recycle => (),
+            }),
+        }
+    }
+}
+
 pub(super) async fn handle_requests<H: RequestHandler + Copy + Unpin>(
     handler: H,
     user_code: UserCode,
-    mut recv: tokio::sync::mpsc::UnboundedReceiver<ControlMessage>,
+    recv: SharedReceiver,
     max_request_threads: u32,
+    mut options: WorkerOptions,
 ) {
-    if let Err(e) = handle_requests_inner(handler, user_code, &mut recv, max_request_threads).await
+    if let Err(e) =
+        handle_requests_inner(handler, user_code, &recv, max_request_threads, &mut options).await
     {
+        (options.events)(WorkerEvent::Failed(anyhow!("{e:?}")));
+
+        if options.take_over {
+            // Another worker may still be serving requests, leave it be.
+            return;
+        }
+
         // The request handling logic itself failed, so we send back the error
         // as long as the thread is alive and shutdown has not been requested.
-        // This lets us report the error. The runner can shut us down as soon
-        // as it discovers the error.
+        // This lets us report the error. The runner can shut us down, or
+        // replace us, as soon as it discovers the error.
 
         let mut error = Some(e);
+        let mut owner = options.owner.as_ref().map(|owner| owner.subscribe());
+        let mut recv = recv.lock().await;
+        let mut lifecycle = options.lifecycle.clone();
+        if *lifecycle.borrow_and_update() != Lifecycle::Running {
+            recv.close();
+        }
 
         loop {
-            match recv.recv().await {
-                None | Some(ControlMessage::Shutdown) | Some(ControlMessage::Terminate) => break,
-                Some(ControlMessage::HandleRequest(_, resp_tx)) => {
-                    ignore_error(resp_tx.send(ResponseData::ScriptError(error.take())))
-                }
+            select! {
+                msg = recv.recv() => match msg {
+                    None => break,
+                    Some(ControlMessage::HandleRequest(_, resp_tx)) => {
+                        ignore_error(resp_tx.send(ResponseData::ScriptError(error.take())))
+                    }
+                },
+                state = lifecycle_changed(&mut lifecycle) => match state {
+                    Lifecycle::Running => (),
+                    // Keep answering what's already queued until the
+                    // channel runs dry.
+                    Lifecycle::ShuttingDown => recv.close(),
+                    Lifecycle::Terminating => break,
+                },
+                _ = handed_over(&mut owner, options.generation) => break,
             }
         }
     }
 }
 
+async fn recv_if_owned(
+    recv: &mut Option<tokio::sync::MutexGuard<'_, mpsc::Receiver<ControlMessage>>>,
+) -> Option<ControlMessage> {
+    match recv {
+        Some(recv) => recv.recv().await,
+        None => std::future::pending().await,
+    }
+}
+
 async fn handle_requests_inner<H: RequestHandler + Copy + Unpin>(
     mut handler: H,
     user_code: UserCode,
-    recv: &mut tokio::sync::mpsc::UnboundedReceiver<ControlMessage>,
+    recv: &SharedReceiver,
     max_request_threads: u32,
+    options: &mut WorkerOptions,
 ) -> Result<(), anyhow::Error> {
+    let started = Instant::now();
     let is_module_mode = match user_code {
         UserCode::Script { .. } => false,
         UserCode::Directory(_) | UserCode::Module(_) => true,
     };
 
-    let module_loader = is_module_mode.then(runtime::module::Loader::default);
+    let module_loader = is_module_mode
+        .then(|| builtins::internal_js_modules::Loader::new(runtime::module::Loader::default()));
     let standard_modules = TwoStandardModules(
         builtins::Modules {
             include_internal: is_module_mode,
@@ -92,50 +296,107 @@ async fn handle_requests_inner<H: RequestHandler + Copy + Unpin>(
     let js_app = JsApp::build(module_loader, Some(standard_modules));
     let cx = js_app.cx();
     let rt = js_app.rt();
-    let mut event_loop_stream = EventLoopStream { app: &js_app };
 
-    handler.evaluate_scripts(cx, &user_code)?;
+    startup::measure(Phase::UserCode, || handler.evaluate_scripts(cx, &user_code))?;
 
     // Wait for any promises resulting from running the script to be resolved, giving
     // scripts a chance to initialize before accepting requests
     // Note we will return the error here if one happens, since an error happening
     // in this stage means the script didn't initialize successfully.
+    let event_loop_started = Instant::now();
     rt.run_event_loop()
         .await
         .map_err(|e| error_report_option_to_anyhow_error(cx, e))?;
+    startup::record(Phase::FirstEventLoop, event_loop_started.elapsed());
+
+    startup::worker_ready(started.elapsed());
+    (options.events)(WorkerEvent::Ready);
+
+    let mut owner = options.owner.as_ref().map(|owner| {
+        owner.send_replace(options.generation);
+        owner.subscribe()
+    });
+
+    // When taking over, this waits until the previous worker has seen that
+    // we own the channel now.
+    let mut recv = Some(recv.lock().await);
+
+    let cpu_watch = CpuWatch::new(cx, options.cpu_budget).map(Rc::new);
+    let mut event_loop_stream = EventLoopStream {
+        app: &js_app,
+        cpu_watch: cpu_watch.clone(),
+    };
 
     let mut request_queue = RequestQueue::new(cx);
 
-    let mut shutdown_requested = false;
+    // Shutting down closes the channel, so that we get the requests that
+    // were already queued and then see the channel end.
+    let mut lifecycle = options.lifecycle.clone();
+    match *lifecycle.borrow_and_update() {
+        Lifecycle::Running => (),
+        Lifecycle::ShuttingDown => {
+            if let Some(recv) = recv.as_mut() {
+                recv.close();
+            }
+        }
+        Lifecycle::Terminating => return Ok(()),
+    }
+
+    let mut handled_requests = 0u64;
+    let mut recycle_requested = false;
 
     loop {
-        if shutdown_requested && rt.event_loop_is_empty() && request_queue.is_empty() {
+        // We stop reading the channel once another worker takes it over,
+        // which is just like a shutdown for us.
+        if recv.is_none() && rt.event_loop_is_empty() && request_queue.is_empty() {
             break;
         }
 
         select! {
-            msg = recv.recv() => {
-                match msg {
-                    None | Some(ControlMessage::Shutdown) => {
-                        shutdown_requested = true;
-                    },
-                    Some(ControlMessage::Terminate) => {
+            state = lifecycle_changed(&mut lifecycle) => {
+                match state {
+                    Lifecycle::Running => (),
+                    Lifecycle::ShuttingDown => {
+                        if let Some(recv) = recv.as_mut() {
+                            recv.close();
+                        }
+                    }
+                    Lifecycle::Terminating => {
                         request_queue.cancel_all(RequestCancelledReason::ServerShuttingDown);
                         return Ok(());
                     }
-                    Some(ControlMessage::HandleRequest(req, resp_tx)) => {
-                        if shutdown_requested {
-                            ignore_error(resp_tx.send(ResponseData::ScriptError(Some(
-                                anyhow!("New request received after shutdown requested")
-                            ))));
-                        } else {
-                            handle_new_request(
-                                cx,
-                                handler,
-                                &mut request_queue,
-                                req,
-                                resp_tx
-                            );
+                }
+            }
+
+            _ = handed_over(&mut owner, options.generation), if recv.is_some() => {
+                tracing::debug!("Handing requests over to new worker");
+                recv = None;
+            }
+
+            msg = recv_if_owned(&mut recv) => {
+                match msg {
+                    None => {
+                        recv = None;
+                    },
+                    Some(ControlMessage::HandleRequest(mut req, resp_tx)) => {
+                        // The request no longer takes up room in the channel.
+                        req.queue_slot = None;
+
+                        handle_new_request(
+                            cx,
+                            handler,
+                            &mut request_queue,
+                            cpu_watch.as_ref(),
+                            req,
+                            resp_tx
+                        );
+
+                        handled_requests += 1;
+                        if !recycle_requested
+                            && options.recycle.should_recycle(cx, handled_requests)
+                        {
+                            recycle_requested = true;
+                            (options.events)(WorkerEvent::Recycle);
                         }
                     }
                 }
@@ -172,17 +433,41 @@ fn handle_new_request<H: RequestHandler + Copy + Unpin>(
     cx: &Context,
     mut handler: H,
     request_queue: &mut RequestQueue<RequestFinishedCallback<H>>,
+    cpu_watch: Option<&Rc<CpuWatch>>,
     req: RequestData,
     resp_tx: oneshot::Sender<ResponseData>,
 ) {
     tracing::trace!(%req.req.method, %req.req.uri, ?req.req.headers, "Incoming request");
-    match handler.start_handling_request(
-        cx.duplicate(),
-        Request {
-            parts: req.req,
-            body: req.body,
+
+    if resp_tx.is_closed() {
+        // The client went away while the request was waiting in the channel.
+        tracing::debug!("Skipping request from disconnected client");
+        return;
+    }
+
+    let mut cpu = cpu_watch.map(|watch| RequestCpu::new(watch.clone(), &req.req));
+    let signal = RequestSignal::default();
+    let request = Request {
+        parts: req.req,
+        body: req.body,
+    };
+    let start = || {
+        request_signal::with_signal(&signal, || {
+            handler.start_handling_request(cx.duplicate(), request)
+        })
+    };
+    let result = match cpu.as_mut() {
+        Some(cpu) => match cpu.run(start) {
+            Some(result) => result,
+            None => {
+                ignore_error(resp_tx.send(ResponseData::Done(budget_exceeded_response())));
+                return;
+            }
         },
-    ) {
+        None => start(),
+    };
+
+    match result {
         Err(f) => ignore_error(resp_tx.send(ResponseData::RequestError(f))),
         Ok(Either::Left(pending)) => request_queue.push(
             pending,
@@ -190,6 +475,8 @@ fn handle_new_request<H: RequestHandler + Copy + Unpin>(
                 cx: cx.as_ptr(),
                 handler,
                 resp_tx: Some(resp_tx),
+                cpu,
+                signal,
             },
         ),
         Ok(Either::Right(resp)) => {
@@ -211,6 +498,8 @@ struct RequestFinishedCallback<H: RequestHandler + Copy + Unpin> {
     cx: *mut JSContext,
     handler: H,
     resp_tx: Option<oneshot::Sender<ResponseData>>,
+    cpu: Option<RequestCpu>,
+    signal: RequestSignal,
 }
 
 impl<H: RequestHandler + Copy + Unpin> RequestFinishedCallback<H> {
@@ -228,9 +517,20 @@ impl<H: RequestHandler + Copy + Unpin> RequestFinishedHandler for RequestFinishe
         &mut self,
         result: Result<TracedHeap<JSVal>, TracedHeap<JSVal>>,
     ) -> RequestFinishedResult {
-        let response = self
-            .handler
-            .finish_request(unsafe { Context::new_unchecked(self.cx) }, result);
+        let cx = unsafe { Context::new_unchecked(self.cx) };
+        let response = match self.cpu.as_mut() {
+            Some(cpu) => match cpu.run(|| self.handler.finish_request(cx, result)) {
+                Some(response) => response,
+                None => {
+                    ignore_error(
+                        self.get_resp_tx()
+                            .send(ResponseData::Done(budget_exceeded_response())),
+                    );
+                    return RequestFinishedResult::Done;
+                }
+            },
+            None => self.handler.finish_request(cx, result),
+        };
         match response {
             Ok(Either::Left(pending)) => RequestFinishedResult::Pending(pending.promise),
             Ok(Either::Right(response)) => {
@@ -276,4 +576,21 @@ impl<H: RequestHandler + Copy + Unpin> RequestFinishedHandler for RequestFinishe
             }
         }
     }
+
+    fn poll_abandoned(&mut self, wcx: &mut std::task::Context<'_>) -> Poll<()> {
+        match self.resp_tx.as_mut() {
+            Some(resp_tx) => std::task::ready!(resp_tx.poll_closed(wcx)),
+            None => return Poll::Pending,
+        }
+
+        tracing::debug!("Client disconnected, aborting request");
+        let cx = unsafe { Context::new_unchecked(self.cx) };
+        match self.cpu.as_mut() {
+            Some(cpu) => {
+                cpu.run(|| self.signal.abort(&cx));
+            }
+            None => self.signal.abort(&cx),
+        }
+        Poll::Ready(())
+    }
 }
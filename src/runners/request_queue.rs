@@ -15,6 +15,12 @@ pub trait RequestFinishedHandler: Unpin {
     ) -> RequestFinishedResult;
 
     fn request_cancelled(&mut self, reason: Self::CancelReason);
+
+    /// Resolves once nobody is waiting for the response any more. The
+    /// request is then dropped from the queue without being finished.
+    fn poll_abandoned(&mut self, _cx: &mut std::task::Context<'_>) -> Poll<()> {
+        Poll::Pending
+    }
 }
 
 pub struct RequestQueue<F: RequestFinishedHandler> {
@@ -130,6 +136,10 @@ impl<F: RequestFinishedHandler> Future for RequestFuture<F> {
     type Output = Option<Pin<Box<dyn Future<Output = ()>>>>;
 
     fn poll(mut self: Pin<&mut Self>, wcx: &mut std::task::Context<'_>) -> Poll<Self::Output> {
+        if self.on_finished.poll_abandoned(wcx).is_ready() {
+            return Poll::Ready(None);
+        }
+
         match self.promise.poll_unpin(wcx) {
             Poll::Pending => Poll::Pending,
             Poll::Ready((cx, res)) => match self.on_finished.request_finished(res) {
@@ -2,176 +2,385 @@
 //! piece (or set) of JS code and runs it forever, as opposed to watching for
 //! changes. It's a terrible name, I know, but I can't think of a better one
 //! right now. Maybe I'll rename it later.
+//!
+//! The request path never takes a lock: the worker table is allocated once
+//! with `max_threads` slots, and each slot owns its request channel for the
+//! lifetime of the runner. Activating a slot is a single compare-and-swap on
+//! the number of spawned workers, after which requests can be queued into
+//! the slot's channel right away. Actually starting the thread happens on a
+//! separate supervisor thread, so a slow spawn never holds up other requests.
+//!
+//! The supervisor also keeps the slots staffed: workers that fail or die are
+//! replaced in the background, and workers can be recycled after a number of
+//! requests or once their heap grows too large. See [`super::supervisor`].
 
 use std::{
-    sync::{atomic::AtomicI32, Arc},
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        Arc,
+    },
     time::{Duration, Instant},
 };
 
-use anyhow::anyhow;
+use anyhow::{anyhow, Context as _};
 use async_trait::async_trait;
-use tokio::{sync::Mutex, task::LocalSet};
+use tokio::sync::mpsc;
 
 use crate::{
-    request_handlers::{RequestHandler, UserCode},
-    runners::{request_loop::handle_requests, ResponseData},
+    request_handlers::{RequestBody, RequestHandler, UserCode},
+    runners::ResponseData,
 };
 
-use super::request_loop::{ControlMessage, RequestData};
+use super::{
+    admission::{AdmissionConfig, AdmissionController, QueueSlot, Rejection, WorkerLoad},
+    balancing::{Balancer, BalancingPolicy},
+    request_loop::{
+        advance_lifecycle, lifecycle, ControlMessage, Lifecycle, LifecycleSender, RecyclePolicy,
+        RequestData, WorkerReadySender,
+    },
+    supervisor::{Supervisor, SupervisorMessage},
+    watchdog::{self, CpuBudget},
+};
+
+#[derive(Clone, Debug)]
+pub struct SingleRunnerConfig {
+    pub max_threads: usize,
+    /// Number of workers to start and initialize before the server starts
+    /// accepting requests. More workers are still spawned on demand, up to
+    /// `max_threads`.
+    pub min_threads: usize,
+    pub admission: AdmissionConfig,
+    pub recycle: RecyclePolicy,
+    pub balancing: BalancingPolicy,
+    pub cpu_budget: CpuBudget,
+}
 
-pub struct WorkerThreadInfo {
-    thread: std::thread::JoinHandle<()>,
-    channel: tokio::sync::mpsc::UnboundedSender<ControlMessage>,
-    in_flight_requests: Arc<AtomicI32>,
+pub struct WorkerSlot {
+    pub(super) channel: mpsc::Sender<ControlMessage>,
+    pub(super) load: Arc<WorkerLoad>,
+    // Cleared by the supervisor while the slot has no working worker.
+    pub(super) available: Arc<AtomicBool>,
+    // Usually one, but both the old and new workers are running while a
+    // worker is being replaced.
+    pub(super) running_threads: Arc<AtomicUsize>,
 }
 
-impl WorkerThreadInfo {
+impl WorkerSlot {
+    pub(super) fn new(channel_capacity: usize) -> (Self, mpsc::Receiver<ControlMessage>) {
+        let (tx, rx) = mpsc::channel(channel_capacity);
+        let slot = Self {
+            channel: tx,
+            load: Default::default(),
+            available: Arc::new(AtomicBool::new(true)),
+            running_threads: Default::default(),
+        };
+        (slot, rx)
+    }
+
+    /// Counts a new thread as running for this slot. The thread should hold
+    /// on to the guard until it exits.
+    pub(super) fn start_thread(&self) -> WorkerThreadGuard {
+        WorkerThreadGuard::new(self.running_threads.clone())
+    }
+
+    pub(super) fn is_available(&self) -> bool {
+        self.available.load(Ordering::Acquire)
+    }
+
     pub fn is_finished(&self) -> bool {
-        self.thread.is_finished()
+        self.running_threads.load(Ordering::Acquire) == 0
     }
 }
 
-// TODO: replace failing threads
-pub struct SingleRunner<H: RequestHandler + Copy + Unpin> {
-    threads: Vec<WorkerThreadInfo>,
-    max_threads: usize,
-    handler: H,
-    user_code: UserCode,
-    shut_down: bool,
+pub struct SingleRunner {
+    workers: Box<[WorkerSlot]>,
+    min_threads: usize,
+    spawned_workers: AtomicUsize,
+    supervisor: mpsc::UnboundedSender<SupervisorMessage>,
+    admission: AdmissionController,
+    balancer: Balancer,
+    shut_down: Arc<AtomicBool>,
+    lifecycle: LifecycleSender,
 }
 
-pub type SharedSingleRunner<H> = Arc<Mutex<SingleRunner<H>>>;
+pub type SharedSingleRunner = Arc<SingleRunner>;
 
-impl<H: RequestHandler + Copy + Unpin> SingleRunner<H> {
-    pub fn new(max_threads: usize, handler: H, user_code: UserCode) -> Self {
+impl SingleRunner {
+    pub fn new<H: RequestHandler + Copy + Unpin>(
+        config: SingleRunnerConfig,
+        handler: H,
+        user_code: UserCode,
+    ) -> Self {
+        let max_threads = config.max_threads;
         if max_threads == 0 {
             panic!("max_threads must be at least 1");
         }
+        if config.min_threads > max_threads {
+            panic!("min_threads cannot be more than max_threads");
+        }
 
-        Self {
-            threads: vec![],
-            max_threads,
+        let admission = AdmissionController::new(config.admission);
+
+        let mut workers = Vec::with_capacity(max_threads);
+        let mut receivers = Vec::with_capacity(max_threads);
+        for _ in 0..max_threads {
+            let (slot, rx) = WorkerSlot::new(admission.config().channel_capacity());
+            workers.push(slot);
+            receivers.push(rx);
+        }
+
+        let shut_down = Arc::new(AtomicBool::new(false));
+        let (lifecycle_tx, lifecycle_rx) = lifecycle();
+
+        let (supervisor_tx, supervisor_rx) = mpsc::unbounded_channel();
+        let supervisor = Supervisor::new(
             handler,
             user_code,
-            shut_down: false,
+            &workers,
+            receivers,
+            config.recycle,
+            config.cpu_budget,
+            shut_down.clone(),
+            lifecycle_rx,
+            supervisor_tx.clone(),
+        );
+        std::thread::spawn(move || supervisor.run(supervisor_rx));
+
+        Self {
+            workers: workers.into_boxed_slice(),
+            min_threads: config.min_threads,
+            spawned_workers: AtomicUsize::new(0),
+            supervisor: supervisor_tx,
+            admission,
+            balancer: Balancer::new(config.balancing),
+            shut_down,
+            lifecycle: lifecycle_tx,
         }
     }
 
-    pub fn new_request_handler(
+    pub fn new_request_handler<H: RequestHandler + Copy + Unpin>(
         handler: H,
-        max_threads: usize,
+        config: SingleRunnerConfig,
         user_code: UserCode,
-    ) -> SharedSingleRunner<H> {
-        Arc::new(Mutex::new(Self::new(max_threads, handler, user_code)))
-    }
-
-    fn spawn_thread(&mut self) -> &WorkerThreadInfo {
-        let (tx, rx) = tokio::sync::mpsc::unbounded_channel();
-        let handler = self.handler;
-        let user_code = self.user_code.clone();
-        let max_threads = self.max_threads;
-        let join_handle = std::thread::spawn(move || {
-            tokio::runtime::Builder::new_current_thread()
-                .enable_all()
-                .build()
-                .unwrap()
-                .block_on(async move {
-                    let local_set = LocalSet::new();
-                    local_set
-                        .run_until(handle_requests(handler, user_code, rx, max_threads as u32))
-                        .await
-                })
-        });
-        let worker = WorkerThreadInfo {
-            thread: join_handle,
-            channel: tx,
-            in_flight_requests: Arc::new(AtomicI32::new(0)),
-        };
-        self.threads.push(worker);
-        let spawned_index = self.threads.len() - 1;
-        tracing::debug!("Starting new handler thread #{spawned_index}");
-        &self.threads[spawned_index]
+    ) -> SharedSingleRunner {
+        Arc::new(Self::new(config, handler, user_code))
     }
 
-    fn find_or_spawn_thread(&mut self) -> Option<&WorkerThreadInfo> {
-        if self.shut_down {
-            return None;
-        }
+    fn spawned_workers(&self) -> &[WorkerSlot] {
+        &self.workers[..self.spawned_workers.load(Ordering::Acquire)]
+    }
 
-        let request_counts = self
-            .threads
-            .iter()
-            .enumerate()
-            .map(|(idx, t)| {
-                (
-                    idx,
-                    t.in_flight_requests
-                        .load(std::sync::atomic::Ordering::SeqCst),
-                )
+    fn spawn_worker(&self, index: usize, ready: Option<WorkerReadySender>) {
+        // The thread counts as running from here on, so shutdown waits
+        // for it even if the supervisor hasn't started it yet.
+        let guard = self.workers[index].start_thread();
+        if self
+            .supervisor
+            .send(SupervisorMessage::SpawnWorker {
+                index,
+                ready,
+                guard,
             })
-            .collect::<Vec<_>>();
+            .is_err()
+        {
+            tracing::error!("Worker supervisor is not running");
+        }
+    }
+
+    fn find_or_spawn_worker(&self) -> Option<&WorkerSlot> {
+        loop {
+            if self.shut_down.load(Ordering::Acquire) {
+                return None;
+            }
+
+            let spawned = self.spawned_workers.load(Ordering::Acquire);
+            let workers = &self.workers[..spawned];
 
-        // Step 1: are there any idle threads?
-        for t in &request_counts {
-            if t.1 <= 0 {
-                tracing::debug!("Using idle handler thread #{}", t.0);
-                return Some(&self.threads[t.0]);
+            // Step 1: let the balancing policy pick a thread, and use it
+            // right away if it's idle and working
+            let picked = (spawned > 0).then(|| self.balancer.pick(workers));
+            if let Some(idx) = picked {
+                if workers[idx].is_available() && workers[idx].load.in_flight_requests() <= 0 {
+                    tracing::debug!("Using idle handler thread #{idx}");
+                    return Some(&workers[idx]);
+                }
             }
+
+            // Step 2: can we spawn a new thread? Claiming the slot is enough
+            // to start sending requests to it, since its channel already
+            // exists; the supervisor will start the thread in the background.
+            if spawned < self.workers.len() {
+                if self
+                    .spawned_workers
+                    .compare_exchange(spawned, spawned + 1, Ordering::AcqRel, Ordering::Acquire)
+                    .is_ok()
+                {
+                    tracing::debug!("Spawning new request handler thread #{spawned}");
+                    self.spawn_worker(spawned, None);
+                    return Some(&self.workers[spawned]);
+                }
+
+                // Somebody else claimed the slot first, start over with the
+                // updated worker count.
+                continue;
+            }
+
+            // Step 3: go with the thread the policy picked
+            // unwrap safety: all slots are spawned at this point, and there
+            // is always at least one slot
+            let idx = picked.unwrap();
+            let worker = &workers[idx];
+            tracing::debug!(
+                "Reusing busy handler thread #{idx} with in-flight request count {}",
+                worker.load.in_flight_requests()
+            );
+            return Some(worker);
         }
+    }
 
-        // Step 2: can we spawn a new thread?
-        if self.threads.len() < self.max_threads {
-            tracing::debug!("Spawning new request handler thread");
-            return Some(self.spawn_thread());
+    // Balancing policies other than least-requests don't necessarily pick
+    // the least loaded worker, so a request is only rejected once none of
+    // the available workers will take it.
+    fn admit<'a>(
+        &'a self,
+        picked: &'a WorkerSlot,
+    ) -> Result<(&'a WorkerSlot, QueueSlot), Rejection> {
+        let rejection = match self.admission.check(&picked.load) {
+            Ok(slot) => return Ok((picked, slot)),
+            Err(rejection) => rejection,
+        };
+
+        self.spawned_workers()
+            .iter()
+            .filter(|w| !std::ptr::eq(*w, picked) && w.is_available())
+            .find_map(|w| self.admission.check(&w.load).ok().map(|slot| (w, slot)))
+            .ok_or(rejection)
+    }
+}
+
+/// Keeps a worker slot's running thread count up to date, even if the
+/// thread panics.
+pub(super) struct WorkerThreadGuard {
+    running_threads: Arc<AtomicUsize>,
+    on_exit: Option<Box<dyn FnOnce() + Send>>,
+}
+
+impl WorkerThreadGuard {
+    pub(super) fn new(running_threads: Arc<AtomicUsize>) -> Self {
+        running_threads.fetch_add(1, Ordering::AcqRel);
+        Self {
+            running_threads,
+            on_exit: None,
         }
+    }
 
-        // Step 3: find the thread with the least active requests
-        // unwrap safety: request_counts can never be empty
-        let min = request_counts.iter().min_by_key(|t| t.1).unwrap();
-        tracing::debug!(
-            "Reusing busy handler thread #{} with in-flight request count {}",
-            min.0,
-            self.threads[min.0]
-                .in_flight_requests
-                .load(std::sync::atomic::Ordering::SeqCst)
-        );
-        Some(&self.threads[min.0])
+    pub(super) fn on_exit(mut self, f: impl FnOnce() + Send + 'static) -> Self {
+        self.on_exit = Some(Box::new(f));
+        self
+    }
+}
+
+impl Drop for WorkerThreadGuard {
+    fn drop(&mut self) {
+        self.running_threads.fetch_sub(1, Ordering::AcqRel);
+        if let Some(f) = self.on_exit.take() {
+            f();
+        }
     }
 }
 
 #[async_trait]
-impl<H: RequestHandler + Copy + Unpin> crate::server::Runner for SharedSingleRunner<H> {
+impl crate::server::Runner for SharedSingleRunner {
+    async fn warm_up(&self) -> anyhow::Result<()> {
+        if self.min_threads == 0 {
+            return Ok(());
+        }
+
+        let started = Instant::now();
+
+        // Claim the first min_threads slots. Nothing else can be claiming
+        // slots this early, but there's no harm in doing it properly.
+        let mut ready = vec![];
+        loop {
+            let spawned = self.spawned_workers.load(Ordering::Acquire);
+            if spawned >= self.min_threads {
+                break;
+            }
+            if self
+                .spawned_workers
+                .compare_exchange(spawned, spawned + 1, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok()
+            {
+                let (tx, rx) = tokio::sync::oneshot::channel();
+                self.spawn_worker(spawned, Some(tx));
+                ready.push(rx);
+            }
+        }
+
+        // All workers initialize in parallel on their own threads, we only
+        // wait for them here.
+        for (index, rx) in futures::future::join_all(ready)
+            .await
+            .into_iter()
+            .enumerate()
+        {
+            rx.map_err(|_| anyhow!("Handler thread #{index} quit during initialization"))?
+                .with_context(|| format!("Handler thread #{index} failed to initialize"))?;
+        }
+
+        tracing::info!(
+            "{} handler threads ready in {} ms",
+            self.min_threads,
+            started.elapsed().as_millis()
+        );
+
+        Ok(())
+    }
+
     async fn handle(
         &self,
         _addr: std::net::SocketAddr,
         req: http::request::Parts,
         body: hyper::Body,
     ) -> Result<hyper::Response<hyper::Body>, anyhow::Error> {
-        let mut this = self.lock().await;
-        let Some(thread) = this.find_or_spawn_thread() else {
-            let response = hyper::Response::builder()
-                .status(503)
-                .body(hyper::Body::from("Server is shutting down"))
-                .expect("Failed to construct 503 response");
-            return Ok(response);
+        let Some(worker) = self.find_or_spawn_worker() else {
+            return Ok(shutting_down_response());
         };
 
-        let request_count = thread.in_flight_requests.clone();
-        let increment_guard = IncrementGuard::new(request_count);
+        let (worker, queue_slot) = match self.admit(worker) {
+            Ok(admitted) => admitted,
+            Err(rejection) => return Ok(self.admission.reject(rejection)),
+        };
 
+        let body = RequestBody::read(&req, body).await?;
         let (tx, rx) = tokio::sync::oneshot::channel();
 
-        thread.channel.send(ControlMessage::HandleRequest(
-            RequestData { _addr, req, body },
+        match worker.channel.try_send(ControlMessage::HandleRequest(
+            RequestData {
+                _addr,
+                req,
+                body,
+                queue_slot: Some(queue_slot),
+            },
             tx,
-        ))?;
+        )) {
+            Ok(()) => (),
+            Err(mpsc::error::TrySendError::Full(_)) => {
+                return Ok(self.admission.reject(Rejection::queue_full()));
+            }
+            Err(mpsc::error::TrySendError::Closed(_)) if self.shut_down.load(Ordering::Acquire) => {
+                return Ok(shutting_down_response());
+            }
+            Err(mpsc::error::TrySendError::Closed(_)) => {
+                return Err(anyhow!("Request handler thread is not running"));
+            }
+        }
 
-        // explicitly drop mutex guard to unlock mutex
-        drop(this);
+        let in_flight_guard = worker.load.start_request();
 
         let response = rx.await?;
 
-        drop(increment_guard);
+        drop(in_flight_guard);
 
         // TODO: handle script errors
         match response {
@@ -189,33 +398,25 @@ impl<H: RequestHandler + Copy + Unpin> crate::server::Runner for SharedSingleRun
     async fn shutdown(&self, timeout: Option<Duration>) {
         tracing::info!("Shutting down...");
 
-        let mut this = self.lock().await;
-        this.shut_down = true;
-        for thread in &this.threads {
-            if !thread.is_finished() {
-                _ = thread.channel.send(ControlMessage::Shutdown);
-            }
-        }
-        // Drop the lock handle so incoming requests can receive an
-        // error response
-        drop(this);
+        // Once this is set, no new slots can be claimed, but a request may
+        // still be racing us on a slot that was claimed just now. Workers
+        // check the lifecycle when they start, so such a worker will still
+        // quit as soon as it has handled its queue.
+        self.shut_down.store(true, Ordering::Release);
+        advance_lifecycle(&self.lifecycle, Lifecycle::ShuttingDown);
 
         let shutdown_started = Instant::now();
 
         loop {
-            let this = self.lock().await;
-            if this.threads.iter().any(|t| !t.is_finished()) {
+            let workers = self.spawned_workers();
+            if workers.iter().any(|t| !t.is_finished()) {
                 if let Some(timeout) = timeout {
                     if shutdown_started.elapsed() >= timeout {
                         tracing::warn!(
                             "Clean shutdown timeout was reached before all \
                             requests could finish processing"
                         );
-                        for t in &this.threads {
-                            if !t.is_finished() {
-                                _ = t.channel.send(ControlMessage::Terminate);
-                            }
-                        }
+                        advance_lifecycle(&self.lifecycle, Lifecycle::Terminating);
                         break;
                     }
                 }
@@ -227,6 +428,13 @@ impl<H: RequestHandler + Copy + Unpin> crate::server::Runner for SharedSingleRun
             }
         }
 
+        watchdog::log_violations();
+
+        let shed_requests = self.admission.shed_requests();
+        if shed_requests > 0 {
+            tracing::info!("{shed_requests} requests were shed due to overload");
+        }
+
         tracing::info!(
             "Shutdown completed in {} seconds",
             shutdown_started.elapsed().as_secs()
@@ -234,19 +442,9 @@ impl<H: RequestHandler + Copy + Unpin> crate::server::Runner for SharedSingleRun
     }
 }
 
-struct IncrementGuard {
-    value: Arc<AtomicI32>,
-}
-
-impl IncrementGuard {
-    fn new(value: Arc<AtomicI32>) -> Self {
-        value.fetch_add(1, std::sync::atomic::Ordering::SeqCst);
-        Self { value }
-    }
-}
-
-impl Drop for IncrementGuard {
-    fn drop(&mut self) {
-        self.value.fetch_sub(1, std::sync::atomic::Ordering::SeqCst);
-    }
+fn shutting_down_response() -> hyper::Response<hyper::Body> {
+    hyper::Response::builder()
+        .status(503)
+        .body(hyper::Body::from("Server is shutting down"))
+        .expect("Failed to construct 503 response")
 }
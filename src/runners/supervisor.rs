@@ -0,0 +1,314 @@
+//! Starts and replaces the worker threads of the single runner. Each slot
+//! in the runner's worker table is served by one worker at a time, and the
+//! supervisor makes sure it stays that way:
+//!
+//! * Workers that fail to evaluate the user code, or whose thread quits
+//!   unexpectedly, are replaced after a delay that grows with each
+//!   consecutive failure.
+//! * Workers that reach their recycling limits are replaced right away.
+//!
+//! A replacement starts up while the old worker is still serving the slot.
+//! Once it's ready, it marks itself as the owner of the slot's channel; the
+//! old worker stops reading the channel, finishes the requests it already
+//! has and quits. No requests are lost or rejected during the switch.
+//!
+//! While a slot has no working worker, because it failed or died and its
+//! replacement isn't up yet, it's marked unavailable so the balancer sends
+//! requests elsewhere.
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        Arc,
+    },
+    time::Duration,
+};
+
+use tokio::{
+    sync::{mpsc, watch},
+    task::LocalSet,
+};
+
+use crate::request_handlers::{RequestHandler, UserCode};
+
+use super::{
+    request_loop::{
+        handle_requests, shared_receiver, ChannelOwner, ControlMessage, LifecycleReceiver,
+        RecyclePolicy, SharedReceiver, WorkerEvent, WorkerOptions, WorkerReadySender,
+    },
+    single::{WorkerSlot, WorkerThreadGuard},
+    watchdog::CpuBudget,
+};
+
+const MIN_RESTART_DELAY: Duration = Duration::from_millis(100);
+const MAX_RESTART_DELAY: Duration = Duration::from_secs(30);
+
+pub(super) enum SupervisorMessage {
+    SpawnWorker {
+        index: usize,
+        ready: Option<WorkerReadySender>,
+        guard: WorkerThreadGuard,
+    },
+    WorkerEvent {
+        index: usize,
+        generation: u64,
+        event: WorkerEvent,
+    },
+    WorkerExited {
+        index: usize,
+        generation: u64,
+    },
+    ReplaceWorker {
+        index: usize,
+        generation: u64,
+    },
+}
+
+struct SupervisedSlot {
+    receiver: SharedReceiver,
+    owner: ChannelOwner,
+    available: Arc<AtomicBool>,
+    running_threads: Arc<AtomicUsize>,
+
+    // Incremented every time a worker is started for the slot, so we can
+    // ignore messages about workers that were already replaced.
+    generation: u64,
+    // The generation of the worker reading the slot's channel, or 0 if
+    // there is none. Lags behind `generation` while a replacement starts.
+    serving: u64,
+    failed: bool,
+    consecutive_failures: u32,
+    ready: Option<WorkerReadySender>,
+}
+
+pub(super) struct Supervisor<H: RequestHandler + Copy + Unpin> {
+    handler: H,
+    user_code: UserCode,
+    slots: Vec<SupervisedSlot>,
+    recycle: RecyclePolicy,
+    cpu_budget: CpuBudget,
+    shut_down: Arc<AtomicBool>,
+    lifecycle: LifecycleReceiver,
+    control: mpsc::UnboundedSender<SupervisorMessage>,
+}
+
+impl<H: RequestHandler + Copy + Unpin> Supervisor<H> {
+    pub(super) fn new(
+        handler: H,
+        user_code: UserCode,
+        workers: &[WorkerSlot],
+        receivers: Vec<mpsc::Receiver<ControlMessage>>,
+        recycle: RecyclePolicy,
+        cpu_budget: CpuBudget,
+        shut_down: Arc<AtomicBool>,
+        lifecycle: LifecycleReceiver,
+        control: mpsc::UnboundedSender<SupervisorMessage>,
+    ) -> Self {
+        let slots = workers
+            .iter()
+            .zip(receivers)
+            .map(|(worker, rx)| SupervisedSlot {
+                receiver: shared_receiver(rx),
+                owner: Arc::new(watch::channel(0).0),
+                available: worker.available.clone(),
+                running_threads: worker.running_threads.clone(),
+                generation: 0,
+                serving: 0,
+                failed: false,
+                consecutive_failures: 0,
+                ready: None,
+            })
+            .collect();
+
+        Self {
+            handler,
+            user_code,
+            slots,
+            recycle,
+            cpu_budget,
+            shut_down,
+            lifecycle,
+            control,
+        }
+    }
+
+    pub(super) fn run(mut self, mut messages: mpsc::UnboundedReceiver<SupervisorMessage>) {
+        while let Some(message) = messages.blocking_recv() {
+            match message {
+                SupervisorMessage::SpawnWorker {
+                    index,
+                    ready,
+                    guard,
+                } => {
+                    if self.slots[index].generation != 0 {
+                        tracing::error!("Handler thread #{index} was already started");
+                        continue;
+                    }
+                    self.slots[index].ready = ready;
+                    self.start_worker(index, guard);
+                }
+
+                SupervisorMessage::WorkerEvent {
+                    index,
+                    generation,
+                    event,
+                } => {
+                    if self.slots[index].generation == generation {
+                        self.handle_event(index, event);
+                    }
+                }
+
+                SupervisorMessage::WorkerExited { index, generation } => {
+                    if self.shut_down.load(Ordering::Acquire) {
+                        continue;
+                    }
+
+                    let slot = &mut self.slots[index];
+                    if slot.serving == generation {
+                        slot.serving = 0;
+                    }
+                    if slot.serving == 0 {
+                        // Whether or not a replacement is on its way, nobody
+                        // reads the channel until it's ready.
+                        slot.available.store(false, Ordering::Release);
+                    }
+
+                    // Workers that were replaced or failed already have a
+                    // replacement starting or scheduled.
+                    if slot.generation != generation || slot.failed {
+                        continue;
+                    }
+
+                    tracing::error!("Handler thread #{index} quit unexpectedly");
+                    self.schedule_replacement(index);
+                }
+
+                SupervisorMessage::ReplaceWorker { index, generation } => {
+                    let slot = &self.slots[index];
+                    if self.shut_down.load(Ordering::Acquire) || slot.generation != generation {
+                        continue;
+                    }
+
+                    let guard = WorkerThreadGuard::new(slot.running_threads.clone());
+                    self.start_worker(index, guard);
+                }
+            }
+        }
+    }
+
+    fn handle_event(&mut self, index: usize, event: WorkerEvent) {
+        let slot = &mut self.slots[index];
+        match event {
+            WorkerEvent::Ready => {
+                slot.consecutive_failures = 0;
+                slot.serving = slot.generation;
+                slot.available.store(true, Ordering::Release);
+                if let Some(ready) = slot.ready.take() {
+                    _ = ready.send(Ok(()));
+                }
+                if slot.generation > 1 {
+                    tracing::info!("Handler thread #{index} was replaced");
+                }
+            }
+
+            WorkerEvent::Failed(e) => {
+                slot.failed = true;
+                // Replacements leave the previous worker serving the slot
+                // when they fail, if it's still there.
+                slot.available.store(slot.serving != 0, Ordering::Release);
+                if let Some(ready) = slot.ready.take() {
+                    // Somebody is waiting for this worker to start, let them
+                    // decide what to do about the error.
+                    _ = ready.send(Err(e));
+                    return;
+                }
+
+                tracing::error!("Handler thread #{index} failed to start: {e:?}");
+                self.schedule_replacement(index);
+            }
+
+            WorkerEvent::Recycle => {
+                if self.shut_down.load(Ordering::Acquire) {
+                    return;
+                }
+
+                tracing::info!("Recycling handler thread #{index}");
+                let guard = WorkerThreadGuard::new(slot.running_threads.clone());
+                self.start_worker(index, guard);
+            }
+        }
+    }
+
+    fn schedule_replacement(&mut self, index: usize) {
+        let slot = &mut self.slots[index];
+        let delay = MIN_RESTART_DELAY
+            .saturating_mul(1 << slot.consecutive_failures.min(16))
+            .min(MAX_RESTART_DELAY);
+        slot.consecutive_failures += 1;
+
+        tracing::info!(
+            "Replacing handler thread #{index} in {} ms",
+            delay.as_millis()
+        );
+
+        let generation = slot.generation;
+        let control = self.control.clone();
+        std::thread::spawn(move || {
+            std::thread::sleep(delay);
+            _ = control.send(SupervisorMessage::ReplaceWorker { index, generation });
+        });
+    }
+
+    fn start_worker(&mut self, index: usize, guard: WorkerThreadGuard) {
+        let slot = &mut self.slots[index];
+        slot.generation += 1;
+        slot.failed = false;
+
+        let generation = slot.generation;
+        let events = self.control.clone();
+        let exited = self.control.clone();
+        let options = WorkerOptions {
+            generation,
+            // The first worker of a slot has nobody to take over from.
+            take_over: generation > 1,
+            owner: Some(slot.owner.clone()),
+            lifecycle: self.lifecycle.clone(),
+            recycle: self.recycle,
+            cpu_budget: self.cpu_budget,
+            events: Box::new(move |event| {
+                _ = events.send(SupervisorMessage::WorkerEvent {
+                    index,
+                    generation,
+                    event,
+                });
+            }),
+        };
+        let guard = guard.on_exit(move || {
+            _ = exited.send(SupervisorMessage::WorkerExited { index, generation });
+        });
+
+        let handler = self.handler;
+        let user_code = self.user_code.clone();
+        let receiver = slot.receiver.clone();
+        let max_threads = self.slots.len() as u32;
+        std::thread::spawn(move || {
+            let _guard = guard;
+            tokio::runtime::Builder::new_current_thread()
+                .enable_all()
+                .build()
+                .unwrap()
+                .block_on(async move {
+                    let local_set = LocalSet::new();
+                    local_set
+                        .run_until(handle_requests(
+                            handler,
+                            user_code,
+                            receiver,
+                            max_threads,
+                            options,
+                        ))
+                        .await
+                })
+        });
+    }
+}
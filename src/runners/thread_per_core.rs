@@ -0,0 +1,502 @@
+//! A runner where every JS worker thread accepts and serves its own
+//! connections. Each worker binds its own listener to the server address
+//! with SO_REUSEPORT, so the kernel spreads incoming connections across the
+//! workers, and runs hyper on its own `current_thread` runtime. Requests are
+//! handed to the request loop over a channel that never crosses threads, and
+//! the responses are written back from the same thread, without waking up
+//! any other thread along the way. The exception is a worker whose request
+//! loop died: its replacement runs on a thread of its own.
+//!
+//! The downside is that a connection stays on the worker it was accepted
+//! by: a slow script can't be helped out by idle workers the way the single
+//! runner does it.
+
+use std::{
+    convert::Infallible,
+    future::Future,
+    net::SocketAddr,
+    sync::Arc,
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Context as _};
+use async_trait::async_trait;
+use hyper::{server::conn::Http, service::service_fn, Body, Request, Response};
+use tokio::{
+    net::{TcpListener, TcpSocket},
+    sync::{mpsc, oneshot, watch},
+    task::{JoinSet, LocalSet},
+};
+
+use crate::{
+    request_handlers::{RequestBody, RequestHandler, UserCode},
+    runners::{request_loop::handle_requests, ResponseData},
+};
+
+use super::{
+    admission::{AdmissionConfig, AdmissionController, Rejection, WorkerLoad},
+    request_loop::{
+        advance_lifecycle, lifecycle, shared_receiver, ControlMessage, Lifecycle,
+        LifecycleReceiver, LifecycleSender, RequestData, SharedReceiver, WorkerOptions,
+        WorkerReadySender,
+    },
+    single::WorkerSlot,
+    watchdog::{self, CpuBudget},
+};
+
+// Keeps a loop that dies right away from taking up the whole thread.
+const REQUEST_LOOP_RESTART_DELAY: Duration = Duration::from_millis(100);
+
+#[derive(Clone, Debug)]
+pub struct ThreadPerCoreRunnerConfig {
+    pub addr: SocketAddr,
+    pub threads: usize,
+    pub admission: AdmissionConfig,
+    pub cpu_budget: CpuBudget,
+}
+
+pub struct ThreadPerCoreRunner {
+    workers: Box<[WorkerSlot]>,
+    // One per worker, since each worker shuts its request loop down on its
+    // own once its connections are closed.
+    lifecycles: Box<[Arc<LifecycleSender>]>,
+    ready: parking_lot::Mutex<Vec<oneshot::Receiver<Result<(), anyhow::Error>>>>,
+    admission: Arc<AdmissionController>,
+    shut_down: watch::Sender<bool>,
+}
+
+pub type SharedThreadPerCoreRunner = Arc<ThreadPerCoreRunner>;
+
+impl ThreadPerCoreRunner {
+    pub fn new<H: RequestHandler + Copy + Unpin>(
+        config: ThreadPerCoreRunnerConfig,
+        handler: H,
+        user_code: UserCode,
+    ) -> Self {
+        let threads = config.threads;
+        if threads == 0 {
+            panic!("threads must be at least 1");
+        }
+
+        let admission = Arc::new(AdmissionController::new(config.admission));
+        let (shut_down, shut_down_rx) = watch::channel(false);
+
+        let mut workers = Vec::with_capacity(threads);
+        let mut lifecycles = Vec::with_capacity(threads);
+        let mut ready = Vec::with_capacity(threads);
+        for index in 0..threads {
+            let (slot, rx) = WorkerSlot::new(admission.config().channel_capacity());
+            let (ready_tx, ready_rx) = oneshot::channel();
+            let (lifecycle_tx, lifecycle_rx) = lifecycle();
+            let lifecycle_tx = Arc::new(lifecycle_tx);
+
+            let worker = Worker {
+                channel: slot.channel.clone(),
+                load: slot.load.clone(),
+                admission: admission.clone(),
+            };
+            let user_code = user_code.clone();
+            let shut_down = shut_down_rx.clone();
+            let finished = slot.start_thread();
+            let addr = config.addr;
+            let cpu_budget = config.cpu_budget;
+            let worker_lifecycle = lifecycle_tx.clone();
+            std::thread::spawn(move || {
+                let _finished = finished;
+                tokio::runtime::Builder::new_current_thread()
+                    .enable_all()
+                    .build()
+                    .unwrap()
+                    .block_on(async move {
+                        let local_set = LocalSet::new();
+                        local_set
+                            .run_until(async move {
+                                let listener = match bind_listener(addr) {
+                                    Ok(l) => l,
+                                    Err(e) => {
+                                        _ = ready_tx.send(Err(anyhow::Error::from(e)
+                                            .context(format!("Failed to listen on '{addr}'"))));
+                                        return;
+                                    }
+                                };
+
+                                let request_loop = tokio::task::spawn_local(keep_request_loop(
+                                    index,
+                                    handler,
+                                    user_code,
+                                    shared_receiver(rx),
+                                    threads as u32,
+                                    cpu_budget,
+                                    ready_tx,
+                                    lifecycle_rx,
+                                ));
+
+                                serve_connections(listener, worker.clone(), shut_down).await;
+                                tracing::debug!("Handler thread #{index} stopped accepting");
+
+                                // All connections are closed, so nothing can
+                                // be waiting on the request loop any more.
+                                advance_lifecycle(&worker_lifecycle, Lifecycle::ShuttingDown);
+                                _ = request_loop.await;
+                            })
+                            .await
+                    })
+            });
+
+            workers.push(slot);
+            lifecycles.push(lifecycle_tx);
+            ready.push(ready_rx);
+        }
+
+        Self {
+            workers: workers.into_boxed_slice(),
+            lifecycles: lifecycles.into_boxed_slice(),
+            ready: parking_lot::Mutex::new(ready),
+            admission,
+            shut_down,
+        }
+    }
+
+    pub fn new_request_handler<H: RequestHandler + Copy + Unpin>(
+        handler: H,
+        config: ThreadPerCoreRunnerConfig,
+        user_code: UserCode,
+    ) -> SharedThreadPerCoreRunner {
+        Arc::new(Self::new(config, handler, user_code))
+    }
+}
+
+// The listener stays bound for as long as the thread runs, so if the
+// request loop dies, e.g. because it panicked, it has to be restarted or
+// the connections the kernel sends here would have nobody to serve them.
+// Requests wait in the channel while the new loop starts up.
+//
+// The first loop runs on this thread. A loop that died may have left
+// thread-locals behind that still point into its runtime, so replacements
+// run on a fresh thread of their own, reading the same channel.
+#[allow(clippy::too_many_arguments)]
+async fn keep_request_loop<H: RequestHandler + Copy + Unpin>(
+    index: usize,
+    handler: H,
+    user_code: UserCode,
+    recv: SharedReceiver,
+    threads: u32,
+    cpu_budget: CpuBudget,
+    ready: WorkerReadySender,
+    lifecycle: LifecycleReceiver,
+) {
+    let mut result = tokio::task::spawn_local(handle_requests(
+        handler,
+        user_code.clone(),
+        recv.clone(),
+        threads,
+        WorkerOptions {
+            cpu_budget,
+            ..WorkerOptions::new(Some(ready), lifecycle.clone())
+        },
+    ))
+    .await
+    .map_err(|e| e.to_string());
+
+    loop {
+        if *lifecycle.borrow() != Lifecycle::Running {
+            return;
+        }
+
+        match result {
+            Ok(()) => tracing::error!("Request loop of handler thread #{index} quit unexpectedly"),
+            Err(e) => tracing::error!(error = %e, "Request loop of handler thread #{index} died"),
+        }
+        tokio::time::sleep(REQUEST_LOOP_RESTART_DELAY).await;
+        tracing::info!("Restarting request loop of handler thread #{index}");
+
+        result = spawn_request_loop_thread(
+            handler,
+            user_code.clone(),
+            recv.clone(),
+            threads,
+            WorkerOptions {
+                cpu_budget,
+                ..WorkerOptions::new(None, lifecycle.clone())
+            },
+        )
+        .await;
+    }
+}
+
+// Runs a request loop on a new thread and resolves once the thread exits.
+async fn spawn_request_loop_thread<H: RequestHandler + Copy + Unpin>(
+    handler: H,
+    user_code: UserCode,
+    recv: SharedReceiver,
+    threads: u32,
+    options: WorkerOptions,
+) -> Result<(), String> {
+    let (exited_tx, exited_rx) = oneshot::channel();
+    let spawned = std::thread::Builder::new().spawn(move || {
+        let result = std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
+            tokio::runtime::Builder::new_current_thread()
+                .enable_all()
+                .build()
+                .unwrap()
+                .block_on(async move {
+                    let local_set = LocalSet::new();
+                    local_set
+                        .run_until(handle_requests(handler, user_code, recv, threads, options))
+                        .await
+                })
+        }));
+        _ = exited_tx.send(result.map_err(|_| "request loop panicked".to_owned()));
+    });
+
+    match spawned {
+        Ok(_) => exited_rx
+            .await
+            .unwrap_or_else(|_| Err("request loop thread quit".to_owned())),
+        Err(e) => Err(format!("failed to spawn request loop thread: {e}")),
+    }
+}
+
+pub(crate) fn bind_listener(addr: SocketAddr) -> std::io::Result<TcpListener> {
+    let socket = match addr {
+        SocketAddr::V4(_) => TcpSocket::new_v4()?,
+        SocketAddr::V6(_) => TcpSocket::new_v6()?,
+    };
+
+    set_reuseport(&socket)?;
+    socket.set_reuseaddr(true)?;
+    socket.bind(addr)?;
+    socket.listen(1024)
+}
+
+#[cfg(unix)]
+fn set_reuseport(socket: &TcpSocket) -> std::io::Result<()> {
+    socket.set_reuseport(true)
+}
+
+#[cfg(not(unix))]
+fn set_reuseport(_socket: &TcpSocket) -> std::io::Result<()> {
+    Err(std::io::Error::new(
+        std::io::ErrorKind::Unsupported,
+        "SO_REUSEPORT is not supported on this platform",
+    ))
+}
+
+// The request loop lives on this thread, so hyper must not send our
+// futures to another one.
+#[derive(Clone, Copy)]
+struct LocalExec;
+
+impl<F> hyper::rt::Executor<F> for LocalExec
+where
+    F: Future + 'static,
+{
+    fn execute(&self, fut: F) {
+        tokio::task::spawn_local(fut);
+    }
+}
+
+#[derive(Clone)]
+struct Worker {
+    channel: mpsc::Sender<ControlMessage>,
+    load: Arc<WorkerLoad>,
+    admission: Arc<AdmissionController>,
+}
+
+async fn serve_connections(
+    listener: TcpListener,
+    worker: Worker,
+    mut shut_down: watch::Receiver<bool>,
+) {
+    let http = Http::new().with_executor(LocalExec);
+    let mut connections = JoinSet::new();
+
+    loop {
+        tokio::select! {
+            accepted = listener.accept() => {
+                let (stream, addr) = match accepted {
+                    Ok(a) => a,
+                    Err(e) => {
+                        // Usually means we're out of file descriptors, give
+                        // existing connections some time to finish.
+                        tracing::error!(error = %e, "Failed to accept connection");
+                        tokio::time::sleep(Duration::from_millis(100)).await;
+                        continue;
+                    }
+                };
+
+                _ = stream.set_nodelay(true);
+
+                let worker = worker.clone();
+                let service = service_fn(move |req| {
+                    let worker = worker.clone();
+                    async move { Ok::<_, Infallible>(handle(&worker, addr, req).await) }
+                });
+                let conn = http.serve_connection(stream, service);
+                let mut shut_down = shut_down.clone();
+                connections.spawn_local(async move {
+                    tokio::pin!(conn);
+                    let result = tokio::select! {
+                        result = conn.as_mut() => result,
+                        _ = shut_down.wait_for(|s| *s) => {
+                            conn.as_mut().graceful_shutdown();
+                            conn.await
+                        }
+                    };
+                    if let Err(e) = result {
+                        tracing::debug!(error = %e, "Connection error");
+                    }
+                });
+            }
+
+            Some(_) = connections.join_next(), if !connections.is_empty() => (),
+
+            _ = shut_down.wait_for(|s| *s) => break,
+        }
+    }
+
+    drop(listener);
+    while connections.join_next().await.is_some() {}
+}
+
+async fn handle(worker: &Worker, addr: SocketAddr, req: Request<Body>) -> Response<Body> {
+    match handle_inner(worker, addr, req).await {
+        Ok(r) => r,
+        Err(err) => crate::server::error_response(err.context("JavaScript failed")),
+    }
+}
+
+async fn handle_inner(
+    worker: &Worker,
+    _addr: SocketAddr,
+    req: Request<Body>,
+) -> Result<Response<Body>, anyhow::Error> {
+    let queue_slot = match worker.admission.check(&worker.load) {
+        Ok(slot) => slot,
+        Err(rejection) => return Ok(worker.admission.reject(rejection)),
+    };
+
+    let (req, body) = req.into_parts();
+    let body = RequestBody::read(&req, body).await?;
+    let (tx, rx) = oneshot::channel();
+
+    match worker.channel.try_send(ControlMessage::HandleRequest(
+        RequestData {
+            _addr,
+            req,
+            body,
+            queue_slot: Some(queue_slot),
+        },
+        tx,
+    )) {
+        Ok(()) => (),
+        Err(mpsc::error::TrySendError::Full(_)) => {
+            return Ok(worker.admission.reject(Rejection::queue_full()));
+        }
+        Err(mpsc::error::TrySendError::Closed(_)) => {
+            return Err(anyhow!("Request handler is not running"));
+        }
+    }
+
+    let in_flight_guard = worker.load.start_request();
+
+    let response = rx.await?;
+
+    drop(in_flight_guard);
+
+    // TODO: handle script errors
+    match response {
+        ResponseData::Done(resp) => Ok(resp),
+        ResponseData::RequestError(err) => Err(err),
+        ResponseData::ScriptError(err) => {
+            if let Some(err) = err {
+                println!("{err:?}");
+            }
+            Err(anyhow!("Error encountered while evaluating user script"))
+        }
+    }
+}
+
+#[async_trait]
+impl crate::server::Runner for SharedThreadPerCoreRunner {
+    async fn warm_up(&self) -> anyhow::Result<()> {
+        let started = Instant::now();
+
+        let ready = std::mem::take(&mut *self.ready.lock());
+        for (index, rx) in futures::future::join_all(ready)
+            .await
+            .into_iter()
+            .enumerate()
+        {
+            rx.map_err(|_| anyhow!("Handler thread #{index} quit during initialization"))?
+                .with_context(|| format!("Handler thread #{index} failed to initialize"))?;
+        }
+
+        tracing::info!(
+            "{} handler threads listening in thread-per-core mode, ready in {} ms",
+            self.workers.len(),
+            started.elapsed().as_millis()
+        );
+
+        Ok(())
+    }
+
+    fn accepts_connections(&self) -> bool {
+        true
+    }
+
+    async fn handle(
+        &self,
+        _addr: std::net::SocketAddr,
+        _req: http::request::Parts,
+        _body: hyper::Body,
+    ) -> Result<hyper::Response<hyper::Body>, anyhow::Error> {
+        Err(anyhow!(
+            "The thread-per-core runner serves connections on its own threads"
+        ))
+    }
+
+    async fn shutdown(&self, timeout: Option<Duration>) {
+        tracing::info!("Shutting down...");
+
+        // Workers stop accepting, let their open connections finish and then
+        // shut down their request loop.
+        self.shut_down.send_replace(true);
+
+        let shutdown_started = Instant::now();
+
+        loop {
+            if self.workers.iter().any(|t| !t.is_finished()) {
+                if let Some(timeout) = timeout {
+                    if shutdown_started.elapsed() >= timeout {
+                        tracing::warn!(
+                            "Clean shutdown timeout was reached before all \
+                            requests could finish processing"
+                        );
+                        for lifecycle in self.lifecycles.iter() {
+                            advance_lifecycle(lifecycle, Lifecycle::Terminating);
+                        }
+                        break;
+                    }
+                }
+
+                tracing::debug!("Still waiting for threads to quit...");
+                tokio::time::sleep(Duration::from_secs(1)).await;
+            } else {
+                break;
+            }
+        }
+
+        watchdog::log_violations();
+
+        let shed_requests = self.admission.shed_requests();
+        if shed_requests > 0 {
+            tracing::info!("{shed_requests} requests were shed due to overload");
+        }
+
+        tracing::info!(
+            "Shutdown completed in {} seconds",
+            shutdown_started.elapsed().as_secs()
+        );
+    }
+}
@@ -1,109 +1,257 @@
-// TODO: get watch mode working again
-
-// use std::{path::PathBuf, sync::Arc};
-
-// use anyhow::bail;
-// use tokio::sync::Mutex;
-
-// use crate::request_handlers::{RequestHandler, UserCode};
-
-// use super::single::{SharedSingleRunner, SingleRunner};
-
-// /// Wraps an [`SingleRunner`] with auto-reload capabilities.
-// ///
-// /// Will auto-reload the JS code, and re-initialize the runner on changes.
-// #[derive(Clone)]
-// pub struct WatchRunner {
-//     state: Arc<State>,
-// }
-
-// struct State {
-//     js_path: PathBuf,
-//     handler: Box<dyn RequestHandler>,
-//     max_js_threads: usize,
-//     mutable: Mutex<Option<MutableState>>,
-// }
-
-// struct MutableState {
-//     contents: String,
-//     runner: SharedSingleRunner,
-// }
-
-// // TODO: support watching modules. This is complicated by the fact that we must
-// // watch all modules loaded in after the entry module was loaded as well.
-// impl WatchRunner {
-//     pub fn new(
-//         handler: Box<dyn RequestHandler>,
-//         js_path: PathBuf,
-//         script_mode: bool,
-//         max_js_threads: usize,
-//     ) -> anyhow::Result<Self> {
-//         if !script_mode {
-//             bail!("Watch mode is not compatible with module mode yet. Use --script to run in script mode instead.");
-//         }
-//         Ok(Self {
-//             state: Arc::new(State {
-//                 handler,
-//                 js_path,
-//                 max_js_threads,
-//                 mutable: Mutex::new(None),
-//             }),
-//         })
-//     }
-
-//     async fn acquire_runner(&self) -> Result<SharedSingleRunner, anyhow::Error> {
-//         // WASIX does not support inotify file watching APIs, so we naively
-//         // load the full file contents on every request.
-//         //
-//         // This is slow, but this should be sufficient for debugging.
-//         //
-//         // We should investigate just going by the file modification time.
-//         // but loading the full contents is more reliable.
-
-//         let mut mutable = self.state.mutable.lock().await;
-
-//         let (contents, file_name) = match UserCode::from_path(&self.state.js_path, true)
-//             .await
-//             .unwrap()
-//         {
-//             UserCode::Script { code, file_name } => (code, file_name),
-//             _ => unreachable!(),
-//         };
-
-//         if let Some(mutable) = mutable.as_mut() {
-//             if mutable.contents == contents {
-//                 return Ok(mutable.runner.clone());
-//             }
-//         }
-
-//         tracing::info!(path=%self.state.js_path.display(), "reloaded application code");
-
-//         let runner = SingleRunner::new_request_handler(
-//             self.state.handler.clone(),
-//             self.state.max_js_threads,
-//             UserCode::Script {
-//                 code: contents.clone(),
-//                 file_name,
-//             },
-//         );
-//         *mutable = Some(MutableState {
-//             contents,
-//             runner: runner.clone(),
-//         });
-
-//         Ok(runner)
-//     }
-// }
-
-// #[async_trait::async_trait]
-// impl crate::server::Runner for WatchRunner {
-//     async fn handle(
-//         &self,
-//         addr: std::net::SocketAddr,
-//         req: http::request::Parts,
-//         body: hyper::Body,
-//     ) -> Result<hyper::Response<hyper::Body>, anyhow::Error> {
-//         let runner = self.acquire_runner().await?;
-//         runner.handle(addr, req, body).await
-//     }
-// }
+//! Reloads the app when its code changes, without dropping requests.
+//!
+//! The runner serves from a [`SingleRunner`] pool, and polls the app's files
+//! for changes in the background. When they change, a new pool is started
+//! and warmed up next to the old one, which keeps serving in the meantime.
+//! Once the new pool is ready, new requests go to it, and the old pool is
+//! drained and shut down. If the new code fails to start, the old pool
+//! stays in place.
+//!
+//! Files are polled rather than watched, since WASIX has no file watching
+//! APIs. For module apps, everything under the app's directory is watched,
+//! which covers the whole module graph except for dependencies under
+//! `node_modules`.
+
+use std::{
+    path::{Path, PathBuf},
+    sync::Arc,
+    time::{Duration, SystemTime},
+};
+
+use anyhow::Context as _;
+use async_trait::async_trait;
+use tokio::task::JoinHandle;
+
+use crate::{
+    request_handlers::{RequestHandler, UserCode},
+    server::Runner,
+};
+
+use super::single::{SharedSingleRunner, SingleRunner, SingleRunnerConfig};
+
+const POLL_INTERVAL: Duration = Duration::from_secs(1);
+
+const WATCHED_EXTENSIONS: &[&str] = &["js", "mjs", "cjs", "json"];
+
+#[derive(Clone, Debug)]
+pub struct WatchConfig {
+    pub js_path: PathBuf,
+    pub script_mode: bool,
+}
+
+type PoolFactory = dyn Fn(UserCode) -> SharedSingleRunner + Send + Sync;
+
+// Requests hold on to the pool they were sent to until they have their
+// response, so the pool isn't shut down while a request is still on its way
+// in.
+struct Pool {
+    runner: SharedSingleRunner,
+}
+
+struct State {
+    config: WatchConfig,
+    new_pool: Box<PoolFactory>,
+    current: parking_lot::RwLock<Arc<Pool>>,
+    // The pool that is warming up during a reload. Aborting the watcher
+    // doesn't stop its workers, so shutdown has to.
+    warming: parking_lot::Mutex<Option<SharedSingleRunner>>,
+    watcher: parking_lot::Mutex<Option<JoinHandle<()>>>,
+}
+
+/// Wraps a [`SingleRunner`] with auto-reload capabilities.
+#[derive(Clone)]
+pub struct WatchRunner {
+    state: Arc<State>,
+}
+
+impl WatchRunner {
+    pub fn new_request_handler<H: RequestHandler + Copy + Unpin>(
+        handler: H,
+        config: SingleRunnerConfig,
+        watch: WatchConfig,
+        user_code: UserCode,
+    ) -> Self {
+        // Reloaded pools only take over once a worker is ready to serve.
+        let mut config = config;
+        config.min_threads = config.min_threads.max(1);
+
+        let new_pool: Box<PoolFactory> = Box::new(move |user_code| {
+            SingleRunner::new_request_handler(handler, config.clone(), user_code)
+        });
+        let runner = new_pool(user_code);
+
+        Self {
+            state: Arc::new(State {
+                config: watch,
+                new_pool,
+                current: parking_lot::RwLock::new(Arc::new(Pool { runner })),
+                warming: Default::default(),
+                watcher: Default::default(),
+            }),
+        }
+    }
+}
+
+impl State {
+    fn watch_root(&self) -> PathBuf {
+        let path = &self.config.js_path;
+        if self.config.script_mode || path.is_dir() {
+            path.clone()
+        } else {
+            path.parent().map(Path::to_owned).unwrap_or_default()
+        }
+    }
+
+    async fn watch(self: Arc<Self>) {
+        let root = self.watch_root();
+        let mut last_seen = fingerprint_blocking(root.clone()).await;
+
+        loop {
+            tokio::time::sleep(POLL_INTERVAL).await;
+
+            let seen = fingerprint_blocking(root.clone()).await;
+            if seen == last_seen {
+                continue;
+            }
+
+            // Editors often write files in several steps, so wait for
+            // things to settle down before reloading.
+            last_seen = seen;
+            loop {
+                tokio::time::sleep(POLL_INTERVAL).await;
+                let seen = fingerprint_blocking(root.clone()).await;
+                if seen == last_seen {
+                    break;
+                }
+                last_seen = seen;
+            }
+
+            if let Err(e) = self.reload().await {
+                tracing::error!(
+                    "Failed to reload application code, still serving the previous version: {e:?}"
+                );
+            }
+        }
+    }
+
+    async fn reload(&self) -> anyhow::Result<()> {
+        tracing::info!(path = %self.config.js_path.display(), "Reloading application code");
+
+        let user_code = UserCode::from_path(&self.config.js_path, self.config.script_mode)?;
+        let runner = (self.new_pool)(user_code);
+        *self.warming.lock() = Some(runner.clone());
+        if let Err(e) = runner.warm_up().await {
+            *self.warming.lock() = None;
+            runner.shutdown(None).await;
+            return Err(e).context("New code failed to start");
+        }
+
+        *self.warming.lock() = None;
+        let old = std::mem::replace(&mut *self.current.write(), Arc::new(Pool { runner }));
+        tracing::info!("Switched to reloaded application code");
+
+        tokio::spawn(drain(old));
+        Ok(())
+    }
+}
+
+async fn drain(pool: Arc<Pool>) {
+    // Requests that picked the old pool before the switch keep it until
+    // they have their response. Once they're all done, nothing can reach
+    // the old pool any more, and shutting it down can't reject anything.
+    let mut pool = pool;
+    let runner = loop {
+        match Arc::try_unwrap(pool) {
+            Ok(pool) => break pool.runner,
+            Err(p) => pool = p,
+        }
+        tokio::time::sleep(Duration::from_millis(50)).await;
+    };
+
+    tracing::debug!("Draining previous worker pool");
+    runner.shutdown(None).await;
+}
+
+async fn fingerprint_blocking(root: PathBuf) -> Vec<(PathBuf, SystemTime, u64)> {
+    tokio::task::spawn_blocking(move || {
+        let mut files = vec![];
+        collect_files(&root, &mut files);
+        files.sort();
+        files
+    })
+    .await
+    .unwrap_or_default()
+}
+
+fn collect_files(path: &Path, files: &mut Vec<(PathBuf, SystemTime, u64)>) {
+    let Ok(metadata) = std::fs::metadata(path) else {
+        return;
+    };
+
+    if metadata.is_file() {
+        let modified = metadata.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+        files.push((path.to_owned(), modified, metadata.len()));
+        return;
+    }
+
+    let Ok(entries) = std::fs::read_dir(path) else {
+        return;
+    };
+    for entry in entries.flatten() {
+        let path = entry.path();
+        let name = entry.file_name();
+        let name = name.to_string_lossy();
+
+        if path.is_dir() {
+            // Dependencies aren't expected to change while the server runs,
+            // and there can be a lot of them.
+            if !name.starts_with('.') && name != "node_modules" {
+                collect_files(&path, files);
+            }
+        } else if path
+            .extension()
+            .is_some_and(|ext| WATCHED_EXTENSIONS.iter().any(|e| ext == *e))
+        {
+            collect_files(&path, files);
+        }
+    }
+}
+
+#[async_trait]
+impl Runner for WatchRunner {
+    async fn warm_up(&self) -> anyhow::Result<()> {
+        let runner = self.state.current.read().runner.clone();
+        runner.warm_up().await?;
+
+        let watcher = tokio::spawn(self.state.clone().watch());
+        *self.state.watcher.lock() = Some(watcher);
+        Ok(())
+    }
+
+    async fn handle(
+        &self,
+        addr: std::net::SocketAddr,
+        req: http::request::Parts,
+        body: hyper::Body,
+    ) -> anyhow::Result<hyper::Response<hyper::Body>> {
+        let pool = self.state.current.read().clone();
+        pool.runner.handle(addr, req, body).await
+    }
+
+    async fn shutdown(&self, timeout: Option<Duration>) {
+        if let Some(watcher) = self.state.watcher.lock().take() {
+            watcher.abort();
+        }
+
+        let runner = self.state.current.read().runner.clone();
+
+        // A reload may have been warming up a new pool.
+        let warming = self.state.warming.lock().take();
+        match warming {
+            Some(warming) => {
+                futures::join!(warming.shutdown(timeout), runner.shutdown(timeout));
+            }
+            None => runner.shutdown(timeout).await,
+        }
+    }
+}
@@ -0,0 +1,342 @@
+//! Enforces CPU time budgets on JS workers. Workers multiplex many requests
+//! onto a single thread, so one request stuck in an infinite loop would
+//! otherwise stall every other request on the same worker.
+//!
+//! Workers mark the start and end of every stretch of JS execution (a
+//! "turn") along with the time by which it must finish. A single watchdog
+//! thread checks the running turns of all workers, and asks SpiderMonkey to
+//! run the worker's interrupt callback once a turn runs past its deadline.
+//! The callback then terminates the running script.
+//!
+//! Turns that run on behalf of a known request, i.e. calling the request
+//! handler and processing its response, count towards that request's budget
+//! and fail just that request when they run out. Turns of the event loop,
+//! which run promise jobs and timers of all requests, are limited by the
+//! task budget; the terminated job can't be attributed to a request.
+
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    rc::Rc,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc, Weak,
+    },
+    time::{Duration, Instant},
+};
+
+use ion::Context;
+use mozjs::jsapi::{JSContext, JS_AddInterruptCallback, JS_RequestInterruptCallback};
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct CpuBudget {
+    /// Maximum time a single request may spend running JS.
+    pub per_request: Option<Duration>,
+
+    /// Maximum time any single turn of JS execution may take. Defaults to
+    /// the per-request budget.
+    pub per_task: Option<Duration>,
+}
+
+impl CpuBudget {
+    pub fn is_enabled(&self) -> bool {
+        self.per_request.is_some() || self.per_task.is_some()
+    }
+
+    fn task_limit(&self) -> Option<Duration> {
+        self.per_task.or(self.per_request)
+    }
+}
+
+// Distinct routes we keep violation counts for. Anything above this is
+// counted together, so random URLs can't make the map grow forever.
+const MAX_TRACKED_ROUTES: usize = 1000;
+const OTHER_ROUTES: &str = "(other)";
+
+const EVENT_LOOP_ROUTE: &str = "(event loop)";
+
+struct Watchdog {
+    epoch: Instant,
+    workers: parking_lot::Mutex<Vec<Weak<WorkerClock>>>,
+    tick_us: AtomicU64,
+}
+
+lazy_static::lazy_static! {
+    static ref WATCHDOG: Watchdog = {
+        std::thread::Builder::new()
+            .name("cpu-watchdog".into())
+            .spawn(run_watchdog)
+            .expect("Failed to start CPU watchdog thread");
+        Watchdog {
+            epoch: Instant::now(),
+            workers: Default::default(),
+            tick_us: AtomicU64::new(50_000),
+        }
+    };
+
+    static ref VIOLATIONS: parking_lot::Mutex<HashMap<String, u64>> = Default::default();
+}
+
+fn now_us() -> u64 {
+    WATCHDOG.epoch.elapsed().as_micros() as u64
+}
+
+fn run_watchdog() {
+    loop {
+        std::thread::sleep(Duration::from_micros(
+            WATCHDOG.tick_us.load(Ordering::Relaxed),
+        ));
+
+        let now = now_us();
+        let mut workers = WATCHDOG.workers.lock();
+        workers.retain(|worker| {
+            let Some(worker) = worker.upgrade() else {
+                return false;
+            };
+
+            let deadline = worker.deadline_us.load(Ordering::Acquire);
+            if deadline != 0 && now >= deadline {
+                // The worker double-checks the deadline in the interrupt
+                // callback, so it's fine if the turn has ended by now.
+                if let Some(cx) = *worker.cx.lock() {
+                    unsafe { JS_RequestInterruptCallback(cx.0) };
+                }
+            }
+            true
+        });
+    }
+}
+
+/// Records and logs a budget violation.
+pub(super) fn record_violation(route: &str) {
+    let count = {
+        let mut violations = VIOLATIONS.lock();
+        let key = if violations.contains_key(route) || violations.len() < MAX_TRACKED_ROUTES {
+            route
+        } else {
+            OTHER_ROUTES
+        };
+        let count = violations.entry(key.to_string()).or_default();
+        *count += 1;
+        *count
+    };
+
+    tracing::warn!(
+        route,
+        count,
+        "JS execution exceeded its CPU time budget and was terminated"
+    );
+}
+
+/// Logs the routes with the most budget violations, if there were any.
+pub(super) fn log_violations() {
+    let mut violations: Vec<_> = VIOLATIONS
+        .lock()
+        .iter()
+        .map(|(route, count)| (route.clone(), *count))
+        .collect();
+    if violations.is_empty() {
+        return;
+    }
+
+    violations.sort_by(|a, b| b.1.cmp(&a.1));
+    for (route, count) in violations.into_iter().take(10) {
+        tracing::info!("{count} CPU budget violations on route {route}");
+    }
+}
+
+#[derive(Clone, Copy)]
+struct ContextPtr(*mut JSContext);
+
+// JS_RequestInterruptCallback is the one thing that may be called on a
+// context from other threads, and that's all we use this for.
+unsafe impl Send for ContextPtr {}
+
+struct WorkerClock {
+    // When the current turn runs out of budget, in microseconds since the
+    // watchdog's epoch. Zero when no turn is running.
+    deadline_us: AtomicU64,
+    interrupted: AtomicBool,
+    // Cleared before the context is destroyed.
+    cx: parking_lot::Mutex<Option<ContextPtr>>,
+}
+
+thread_local! {
+    static CURRENT_CLOCK: RefCell<Option<Arc<WorkerClock>>> = RefCell::new(None);
+}
+
+unsafe extern "C" fn interrupt_callback(_cx: *mut JSContext) -> bool {
+    CURRENT_CLOCK.with(|clock| {
+        let clock = clock.borrow();
+        let Some(clock) = clock.as_ref() else {
+            return true;
+        };
+
+        let deadline = clock.deadline_us.load(Ordering::Acquire);
+        if deadline != 0 && now_us() >= deadline {
+            clock.interrupted.store(true, Ordering::Release);
+            // Returning false terminates the running script with an
+            // uncatchable error.
+            false
+        } else {
+            true
+        }
+    })
+}
+
+/// Per-worker handle for timing JS turns.
+pub(super) struct CpuWatch {
+    clock: Arc<WorkerClock>,
+    budget: CpuBudget,
+}
+
+impl CpuWatch {
+    /// Starts watching the worker running on the current thread. Returns
+    /// `None` if no budget is set. Must be dropped before the context is.
+    pub(super) fn new(cx: &Context, budget: CpuBudget) -> Option<Self> {
+        if !budget.is_enabled() {
+            return None;
+        }
+
+        let clock = Arc::new(WorkerClock {
+            deadline_us: AtomicU64::new(0),
+            interrupted: AtomicBool::new(false),
+            cx: parking_lot::Mutex::new(Some(ContextPtr(cx.as_ptr()))),
+        });
+
+        CURRENT_CLOCK.with(|c| *c.borrow_mut() = Some(clock.clone()));
+        unsafe { JS_AddInterruptCallback(cx.as_ptr(), Some(interrupt_callback)) };
+
+        // Check at least ten times per budget, so we don't overshoot by much.
+        let smallest_budget = [budget.per_request, budget.per_task]
+            .into_iter()
+            .flatten()
+            .min()
+            .unwrap();
+        let tick_us = (smallest_budget.as_micros() as u64 / 10).clamp(1_000, 50_000);
+        WATCHDOG.tick_us.fetch_min(tick_us, Ordering::Relaxed);
+        WATCHDOG.workers.lock().push(Arc::downgrade(&clock));
+
+        Some(Self { clock, budget })
+    }
+
+    /// Starts a turn on behalf of a request that has already used up
+    /// `used` of its budget.
+    fn start_request_turn(&self, used: Duration) -> Turn<'_> {
+        let request_limit = self
+            .budget
+            .per_request
+            .map(|budget| budget.saturating_sub(used));
+        let limit = match (request_limit, self.budget.per_task) {
+            (Some(a), Some(b)) => Some(a.min(b)),
+            (a, b) => a.or(b),
+        };
+        self.start_turn(limit)
+    }
+
+    /// Runs a turn that can't be attributed to a single request.
+    pub(super) fn run_task<T>(&self, f: impl FnOnce() -> T) -> T {
+        let turn = self.start_turn(self.budget.task_limit());
+        let result = f();
+        if turn.finish().interrupted {
+            record_violation(EVENT_LOOP_ROUTE);
+        }
+        result
+    }
+
+    fn start_turn(&self, limit: Option<Duration>) -> Turn<'_> {
+        let started = Instant::now();
+        // Zero means no turn is running, so a budget that's already used up
+        // becomes a deadline in the past instead.
+        let deadline = match limit {
+            Some(limit) => (now_us() + limit.as_micros() as u64).max(1),
+            None => 0,
+        };
+        let previous = self.clock.deadline_us.swap(deadline, Ordering::AcqRel);
+        Turn {
+            watch: self,
+            started,
+            previous,
+        }
+    }
+}
+
+impl Drop for CpuWatch {
+    fn drop(&mut self) {
+        *self.clock.cx.lock() = None;
+        CURRENT_CLOCK.with(|c| *c.borrow_mut() = None);
+    }
+}
+
+/// Tracks the CPU time used by a single request.
+pub(super) struct RequestCpu {
+    watch: Rc<CpuWatch>,
+    route: String,
+    used: Duration,
+}
+
+impl RequestCpu {
+    pub(super) fn new(watch: Rc<CpuWatch>, req: &http::request::Parts) -> Self {
+        Self {
+            watch,
+            route: format!("{} {}", req.method, req.uri.path()),
+            used: Duration::ZERO,
+        }
+    }
+
+    /// Runs a turn on behalf of the request. Returns `None` if the request
+    /// ran out of budget and was terminated.
+    pub(super) fn run<T>(&mut self, f: impl FnOnce() -> T) -> Option<T> {
+        let turn = self.watch.start_request_turn(self.used);
+        let result = f();
+        let turn = turn.finish();
+        self.used += turn.elapsed;
+
+        if turn.interrupted {
+            record_violation(&self.route);
+            None
+        } else {
+            Some(result)
+        }
+    }
+}
+
+pub(super) fn budget_exceeded_response() -> hyper::Response<hyper::Body> {
+    hyper::Response::builder()
+        .status(504)
+        .body(hyper::Body::from(
+            "The request exceeded its CPU time budget",
+        ))
+        .expect("Failed to construct 504 response")
+}
+
+struct Turn<'w> {
+    watch: &'w CpuWatch,
+    started: Instant,
+    previous: u64,
+}
+
+struct TurnResult {
+    elapsed: Duration,
+    /// Whether the turn was terminated for exceeding its budget.
+    interrupted: bool,
+}
+
+impl<'w> Turn<'w> {
+    fn finish(self) -> TurnResult {
+        TurnResult {
+            elapsed: self.started.elapsed(),
+            interrupted: self.watch.clock.interrupted.swap(false, Ordering::AcqRel),
+        }
+        // The deadline is restored when self is dropped
+    }
+}
+
+impl<'w> Drop for Turn<'w> {
+    fn drop(&mut self) {
+        self.watch
+            .clock
+            .deadline_us
+            .store(self.previous, Ordering::Release);
+    }
+}
@@ -1,16 +1,23 @@
 use std::convert::Infallible;
 use std::net::SocketAddr;
+use std::sync::Arc;
 use std::time::Duration;
 
 use anyhow::Context as _;
 use async_trait::async_trait;
-use hyper::server::conn::AddrStream;
+use hyper::server::conn::{AddrIncoming, AddrStream};
 use hyper::service::{make_service_fn, service_fn};
 use hyper::{Body, Request, Response, Server};
 
+use crate::http_cache::{HttpCache, HttpCacheConfig};
+
 #[derive(Clone, Debug)]
 pub struct ServerConfig {
     pub addr: SocketAddr,
+    /// Bind with SO_REUSEPORT, so other processes can listen on the same
+    /// address.
+    pub reuse_port: bool,
+    pub http_cache: Option<HttpCacheConfig>,
 }
 
 pub async fn run_server(
@@ -18,7 +25,23 @@ pub async fn run_server(
     handler: BoxedDynRunner,
     shutdown_signal: tokio::sync::oneshot::Receiver<()>,
 ) -> Result<(), anyhow::Error> {
-    let context = AppContext { runner: handler };
+    handler
+        .warm_up()
+        .await
+        .context("failed to start request handlers")?;
+
+    if handler.accepts_connections() {
+        // The runner is already listening on its own worker threads, so
+        // all that's left to do is wait for the shutdown signal.
+        crate::startup::listening();
+        _ = shutdown_signal.await;
+        return Ok(());
+    }
+
+    let context = AppContext {
+        runner: handler,
+        http_cache: config.http_cache.map(|c| Arc::new(HttpCache::new(c))),
+    };
 
     let make_service = make_service_fn(move |conn: &AddrStream| {
         let context = context.clone();
@@ -35,7 +58,16 @@ pub async fn run_server(
     let addr = config.addr;
     tracing::info!(listen=%addr, "starting server on '{addr}'");
 
-    Server::bind(&addr)
+    let server = if config.reuse_port {
+        let listener = crate::runners::thread_per_core::bind_listener(addr)
+            .with_context(|| format!("failed to bind to {addr}"))?;
+        Server::builder(AddrIncoming::from_listener(listener)?)
+    } else {
+        Server::try_bind(&addr).with_context(|| format!("failed to bind to {addr}"))?
+    };
+    crate::startup::listening();
+
+    server
         .serve(make_service)
         .with_graceful_shutdown(async move { _ = shutdown_signal.await })
         .await
@@ -45,6 +77,18 @@ pub async fn run_server(
 #[async_trait]
 #[dyn_clonable::clonable]
 pub trait Runner: Send + Sync + Clone + 'static {
+    /// Called once before the server starts listening. Runners can use this
+    /// to get ready for the first requests.
+    async fn warm_up(&self) -> anyhow::Result<()> {
+        Ok(())
+    }
+
+    /// Whether the runner listens for and serves connections itself,
+    /// instead of having requests passed to [`Runner::handle`].
+    fn accepts_connections(&self) -> bool {
+        false
+    }
+
     async fn handle(
         &self,
         addr: SocketAddr,
@@ -60,6 +104,7 @@ pub type BoxedDynRunner = Box<dyn Runner>;
 #[derive(Clone)]
 struct AppContext {
     runner: BoxedDynRunner,
+    http_cache: Option<Arc<HttpCache>>,
 }
 
 async fn handle(
@@ -69,28 +114,30 @@ async fn handle(
 ) -> Result<Response<Body>, Infallible> {
     let res = match handle_inner(context, addr, req).await {
         Ok(r) => r,
-        Err(err) => {
-            tracing::error!(error = format!("{err:#?}"), "could not process request");
-
-            hyper::Response::builder()
-                .status(hyper::StatusCode::INTERNAL_SERVER_ERROR)
-                .body(hyper::Body::from(err.to_string()))
-                .unwrap()
-        }
+        Err(err) => error_response(err),
     };
 
     Ok(res)
 }
 
+pub fn error_response(err: anyhow::Error) -> Response<Body> {
+    tracing::error!(error = format!("{err:#?}"), "could not process request");
+
+    hyper::Response::builder()
+        .status(hyper::StatusCode::INTERNAL_SERVER_ERROR)
+        .body(hyper::Body::from(err.to_string()))
+        .unwrap()
+}
+
 async fn handle_inner(
     context: AppContext,
     addr: SocketAddr,
     req: Request<Body>,
 ) -> Result<Response<Body>, anyhow::Error> {
     let (parts, body) = req.into_parts();
-    context
-        .runner
-        .handle(addr, parts, body)
-        .await
-        .context("JavaScript failed")
+    let response = match &context.http_cache {
+        Some(cache) => cache.handle(&context.runner, addr, parts, body).await,
+        None => context.runner.handle(addr, parts, body).await,
+    };
+    response.context("JavaScript failed")
 }
@@ -1,14 +1,23 @@
 use std::{ffi::OsStr, path::Path};
 
 use anyhow::{anyhow, Context as _};
-use ion::{module::ModuleLoader, Context, ErrorReport};
+use ion::{
+    module::{Module, ModuleData, ModuleLoader},
+    Context, ErrorReport,
+};
 use mozjs::{
-    jsapi::WeakRefSpecifier,
+    jsapi::{SetModulePrivate, WeakRefSpecifier},
+    jsval::ObjectValue,
     rust::{JSEngine, JSEngineHandle, RealmOptions},
 };
 use runtime::{module::StandardModules, Runtime, RuntimeBuilder};
 use self_cell::self_cell;
 
+use crate::{
+    code_cache::{self, CodeKind},
+    startup::{self, Phase},
+};
+
 pub static ENGINE: once_cell::sync::Lazy<JSEngineHandle> = once_cell::sync::Lazy::new(|| {
     let engine = JSEngine::init().expect("could not create engine");
     let handle = engine.handle();
@@ -51,10 +60,19 @@ impl JsApp {
         loader: Option<Ml>,
         modules: Option<Std>,
     ) -> Self {
-        let rt = mozjs::rust::Runtime::new(ENGINE.clone());
-        let cx = Context::from_runtime(&rt);
-        let wrapper = ContextWrapper { _rt: rt, cx };
-        Self::new(wrapper, |w| Self::create_runtime(w, loader, modules))
+        let engine = match once_cell::sync::Lazy::get(&ENGINE) {
+            Some(engine) => engine.clone(),
+            None => startup::measure(Phase::EngineInit, || ENGINE.clone()),
+        };
+
+        // Standard modules are initialized while the runtime is being built,
+        // and record their own time.
+        startup::measure_excluding(Phase::Runtime, Phase::StandardModules, || {
+            let rt = mozjs::rust::Runtime::new(engine);
+            let cx = Context::from_runtime(&rt);
+            let wrapper = ContextWrapper { _rt: rt, cx };
+            Self::new(wrapper, |w| Self::create_runtime(w, loader, modules))
+        })
     }
 
     pub fn cx(&self) -> &Context {
@@ -97,8 +115,9 @@ pub fn evaluate_script(
     code: impl AsRef<str>,
     file_name: impl AsRef<OsStr>,
 ) -> anyhow::Result<ion::Value> {
-    ion::script::Script::compile_and_evaluate(cx, Path::new(&file_name), code.as_ref())
-        .map_err(|e| error_report_to_anyhow_error(cx, e))
+    let file_name = file_name.as_ref().to_string_lossy();
+    let stencil = code_cache::get_or_compile(cx, CodeKind::Script, &file_name, code.as_ref())?;
+    code_cache::evaluate_script_stencil(cx, &stencil)
 }
 
 pub fn evaluate_module(
@@ -106,6 +125,9 @@ pub fn evaluate_module(
     path: impl AsRef<Path>,
 ) -> anyhow::Result<ion::module::Module> {
     let path = path.as_ref();
+    let path_str = path
+        .to_str()
+        .ok_or(anyhow!("Script path is not valid UTF-8"))?;
 
     let file_name = path
         .file_name()
@@ -114,16 +136,44 @@ pub fn evaluate_module(
 
     let code = std::fs::read_to_string(path).context("Failed to read script file")?;
 
-    Ok(
-        ion::module::Module::compile_and_evaluate(cx, &file_name, Some(path), &code)
-            .map_err(|e| {
-                error_report_option_to_anyhow_error(cx, Some(e.report)).context(format!(
-                    "Error while loading module during {:?} step",
-                    e.kind
-                ))
-            })?
-            .0,
-    )
+    let module = compile_module(cx, &file_name, Some(path_str), &code)?;
+    module.instantiate(cx).map_err(|e| {
+        error_report_to_anyhow_error(cx, e)
+            .context("Error while loading module during Instantiation step")
+    })?;
+    module.evaluate(cx).map_err(|e| {
+        error_report_to_anyhow_error(cx, e)
+            .context("Error while loading module during Evaluation step")
+    })?;
+
+    Ok(module)
+}
+
+/// Compiles a module through the code cache, without linking or evaluating
+/// it. `name` is the module's name in stack traces. `path` is what the
+/// module loader resolves relative imports against, and what the stencil
+/// is cached under, since different files can have the same name.
+pub fn compile_module(
+    cx: &Context,
+    name: &str,
+    path: Option<&str>,
+    code: &str,
+) -> anyhow::Result<ion::module::Module> {
+    let stencil =
+        code_cache::get_or_compile_as(cx, CodeKind::Module, path.unwrap_or(name), name, code)?;
+    let module = Module(code_cache::instantiate_module_stencil(cx, &stencil)?);
+
+    let data = ModuleData {
+        path: path.map(String::from),
+    };
+    unsafe {
+        SetModulePrivate(
+            module.0.handle().get(),
+            &ObjectValue(data.to_object(cx).handle().get()),
+        )
+    };
+
+    Ok(module)
 }
 
 pub fn error_report_to_anyhow_error(cx: &Context, error_report: ErrorReport) -> anyhow::Error {
@@ -153,10 +203,14 @@ pub struct TwoStandardModules<M1: StandardModules, M2: StandardModules>(pub M1,
 
 impl<M1: StandardModules, M2: StandardModules> StandardModules for TwoStandardModules<M1, M2> {
     fn init(self, cx: &ion::Context, global: &ion::Object) -> bool {
-        self.0.init(cx, global) && self.1.init(cx, global)
+        startup::measure(Phase::StandardModules, || {
+            self.0.init(cx, global) && self.1.init(cx, global)
+        })
     }
 
     fn init_globals(self, cx: &ion::Context, global: &ion::Object) -> bool {
-        self.0.init_globals(cx, global) && self.1.init_globals(cx, global)
+        startup::measure(Phase::StandardModules, || {
+            self.0.init_globals(cx, global) && self.1.init_globals(cx, global)
+        })
     }
 }
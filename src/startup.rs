@@ -0,0 +1,196 @@
+//! Measures where startup time goes. Every worker records how long each
+//! phase of its initialization took and logs the breakdown once it's
+//! ready. With `--startup-report`, a JSON report is written once the
+//! server is listening and the workers started up front are ready to serve
+//! requests.
+
+use std::{
+    cell::RefCell,
+    path::PathBuf,
+    time::{Duration, Instant},
+};
+
+use once_cell::sync::{Lazy, OnceCell};
+use serde::Serialize;
+
+static PROCESS_START: Lazy<Instant> = Lazy::new(Instant::now);
+
+#[derive(Clone, Copy, Debug)]
+pub enum Phase {
+    /// Initializing the SpiderMonkey engine. Only paid by the first worker.
+    EngineInit,
+    /// Creating the JS runtime and global object, except for the parts
+    /// measured separately.
+    Runtime,
+    /// Defining the standard modules and globals.
+    StandardModules,
+    /// Compiling internal modules imported by the user code. Also counted
+    /// in `UserCode`.
+    InternalModules,
+    /// Compiling and evaluating the user code.
+    UserCode,
+    /// Running the event loop until the promises created by the user code
+    /// are settled.
+    FirstEventLoop,
+}
+
+#[derive(Clone, Debug, Default, Serialize)]
+pub struct WorkerStartup {
+    pub engine_init_ms: f64,
+    pub runtime_ms: f64,
+    pub standard_modules_ms: f64,
+    pub internal_modules_ms: f64,
+    pub user_code_ms: f64,
+    pub first_event_loop_ms: f64,
+    pub total_ms: f64,
+}
+
+impl WorkerStartup {
+    fn phase_mut(&mut self, phase: Phase) -> &mut f64 {
+        match phase {
+            Phase::EngineInit => &mut self.engine_init_ms,
+            Phase::Runtime => &mut self.runtime_ms,
+            Phase::StandardModules => &mut self.standard_modules_ms,
+            Phase::InternalModules => &mut self.internal_modules_ms,
+            Phase::UserCode => &mut self.user_code_ms,
+            Phase::FirstEventLoop => &mut self.first_event_loop_ms,
+        }
+    }
+}
+
+#[derive(Debug, Default, Serialize)]
+struct StartupReport {
+    /// From process start until the server started listening.
+    listening_after_ms: Option<f64>,
+    /// From process start until the first worker was ready.
+    first_worker_ready_after_ms: Option<f64>,
+    workers: Vec<WorkerStartup>,
+}
+
+struct ReportState {
+    report: StartupReport,
+    written: bool,
+}
+
+struct ReportConfig {
+    path: PathBuf,
+    /// Number of workers started before the server starts listening.
+    workers: usize,
+}
+
+static REPORT_CONFIG: OnceCell<ReportConfig> = OnceCell::new();
+static REPORT: Lazy<parking_lot::Mutex<ReportState>> = Lazy::new(|| {
+    parking_lot::Mutex::new(ReportState {
+        report: Default::default(),
+        written: false,
+    })
+});
+
+thread_local! {
+    static CURRENT: RefCell<WorkerStartup> = RefCell::new(Default::default());
+}
+
+fn as_ms(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1000.0
+}
+
+/// Marks the start of the process. Should be called first thing in main.
+pub fn process_started() {
+    Lazy::force(&PROCESS_START);
+}
+
+/// Writes a JSON startup report to `path` once the server is up and
+/// `workers` workers are ready.
+pub fn set_report_path(path: PathBuf, workers: usize) {
+    _ = REPORT_CONFIG.set(ReportConfig {
+        path,
+        workers: workers.max(1),
+    });
+}
+
+/// Adds time spent in a phase to the startup of the worker running on the
+/// current thread.
+pub fn record(phase: Phase, elapsed: Duration) {
+    CURRENT.with(|c| *c.borrow_mut().phase_mut(phase) += as_ms(elapsed));
+}
+
+/// Runs `f`, recording the time it takes as part of `phase`.
+pub fn measure<T>(phase: Phase, f: impl FnOnce() -> T) -> T {
+    let started = Instant::now();
+    let result = f();
+    record(phase, started.elapsed());
+    result
+}
+
+/// Like [`measure`], but leaves out time that `f` records as part of
+/// `excluded`.
+pub fn measure_excluding<T>(phase: Phase, excluded: Phase, f: impl FnOnce() -> T) -> T {
+    let excluded_before = CURRENT.with(|c| *c.borrow_mut().phase_mut(excluded));
+    let started = Instant::now();
+    let result = f();
+    let excluded_ms = CURRENT.with(|c| *c.borrow_mut().phase_mut(excluded)) - excluded_before;
+    CURRENT.with(|c| {
+        *c.borrow_mut().phase_mut(phase) += (as_ms(started.elapsed()) - excluded_ms).max(0.0)
+    });
+    result
+}
+
+/// Finishes the startup of the worker running on the current thread.
+pub fn worker_ready(total: Duration) {
+    let mut startup = CURRENT.with(|c| std::mem::take(&mut *c.borrow_mut()));
+    startup.total_ms = as_ms(total);
+
+    tracing::info!(
+        "Handler thread {} ready in {:.1} ms (engine {:.1} ms, runtime {:.1} ms, \
+        standard modules {:.1} ms, user code {:.1} ms of which internal modules {:.1} ms, \
+        event loop {:.1} ms)",
+        std::thread::current().name().unwrap_or("<unnamed>"),
+        startup.total_ms,
+        startup.engine_init_ms,
+        startup.runtime_ms,
+        startup.standard_modules_ms,
+        startup.user_code_ms,
+        startup.internal_modules_ms,
+        startup.first_event_loop_ms,
+    );
+
+    let mut state = REPORT.lock();
+    state
+        .report
+        .first_worker_ready_after_ms
+        .get_or_insert_with(|| as_ms(PROCESS_START.elapsed()));
+    state.report.workers.push(startup);
+    write_report_if_complete(&mut state);
+}
+
+/// Marks the point where the server started accepting connections.
+pub fn listening() {
+    let mut state = REPORT.lock();
+    state.report.listening_after_ms = Some(as_ms(PROCESS_START.elapsed()));
+    tracing::info!(
+        "Server listening {:.1} ms after process start",
+        state.report.listening_after_ms.unwrap()
+    );
+    write_report_if_complete(&mut state);
+}
+
+fn write_report_if_complete(state: &mut ReportState) {
+    let Some(config) = REPORT_CONFIG.get() else {
+        return;
+    };
+    if state.written
+        || state.report.listening_after_ms.is_none()
+        || state.report.workers.len() < config.workers
+    {
+        return;
+    }
+
+    let path = &config.path;
+    state.written = true;
+    let result = serde_json::to_vec_pretty(&state.report)
+        .map_err(anyhow::Error::from)
+        .and_then(|json| std::fs::write(path, json).map_err(anyhow::Error::from));
+    if let Err(e) = result {
+        tracing::warn!(error = %e, "Failed to write startup report to {}", path.display());
+    }
+}
@@ -24,6 +24,7 @@ import { handleRequest as handleCryptoSha } from "./test-files/16.2-crypto-sha.j
 import { handleRequest as handleCache } from "./test-files/17-cache.js";
 import { handleRequest as handleEvent } from "./test-files/18-event.js";
 import { handleRequest as handleAbort } from "./test-files/19-abort.js";
+import { handleRequest as handleHttpCache } from "./test-files/20-http-cache.js";
 
 function router(req) {
   const url = new URL(req.url);
@@ -107,6 +108,9 @@ function router(req) {
   if (path.startsWith("/19-abort")) {
     return handleAbort(req);
   }
+  if (path.startsWith("/20-http-cache")) {
+    return handleHttpCache(req);
+  }
   return new Response(`Route Not Found - ${path}`, { status: 404 });
 }
 
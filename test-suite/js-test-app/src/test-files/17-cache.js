@@ -2484,6 +2484,57 @@ async function handleRequest(request) {
     //     });
     // }, 'CacheStorage names are DOMStrings not USVStrings');
 
+    await cache_test(async function (cache) {
+      var url = 'http://example.com/round-trip?q=1';
+      var search_less_url = 'http://example.com/round-trip';
+      var request_for = function (language) {
+        return new Request(url, { headers: { 'Accept-Language': language } });
+      };
+      var response_for = function (body) {
+        return new Response(body, { headers: { 'Vary': 'Accept-Language' } });
+      };
+
+      await cache.put(request_for('en'), response_for('english'));
+      await cache.put(request_for('fr'), response_for('french'));
+
+      var response = await cache.match(request_for('fr'));
+      assert_equals(await response.text(), 'french',
+        'Cache.match should return the variant with the same Vary headers');
+      assert_equals(response.headers.get('Vary'), 'Accept-Language',
+        'Cache.match should return the stored response headers');
+      assert_equals(await cache.match(request_for('de')), undefined,
+        'Cache.match should not match other values of Vary headers');
+      assert_equals(await cache.match(url), undefined,
+        'Cache.match should not match a request without the Vary header');
+      assert_equals(await cache.match(search_less_url, { ignoreVary: true }),
+        undefined,
+        'Cache.match should not ignore the search unless ignoreSearch is set');
+
+      var responses = await cache.matchAll(url, { ignoreVary: true });
+      assert_equals(responses.length, 2,
+        'Cache.matchAll with ignoreVary should return every variant');
+      responses = await cache.matchAll('http://example.com/round-trip?q=2',
+        { ignoreSearch: true, ignoreVary: true });
+      assert_equals(responses.length, 2,
+        'Cache.matchAll with ignoreSearch should ignore the search');
+
+      assert_false(await cache.delete(request_for('de')),
+        'Cache.delete should not delete if Vary headers do not match');
+      assert_true(await cache.delete(request_for('en')),
+        'Cache.delete should delete the matching variant');
+      responses = await cache.matchAll(url, { ignoreVary: true });
+      assert_equals(responses.length, 1,
+        'Cache.delete should leave other variants in place');
+      assert_equals(await responses[0].text(), 'french',
+        'Cache.delete should leave other variants in place');
+
+      assert_true(await cache.delete(search_less_url,
+        { ignoreSearch: true, ignoreVary: true }),
+        'Cache.delete with ignoreSearch and ignoreVary should delete the rest');
+      assert_equals((await cache.keys()).length, 0,
+        'The cache should be empty after deleting everything');
+    }, 'Cache put, match and delete round-trip with Vary, ignoreSearch and ignoreVary');
+
     return new Response('All tests passed!');
   }
   catch (e) {
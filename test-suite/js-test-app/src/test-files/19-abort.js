@@ -4,11 +4,92 @@ import {
   assert_throws_js,
   assert_true,
   async_test,
+  promise_test,
   test,
 } from "../test-utils";
 
-async function handleRequest() {
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+// Where the server side of the disconnect test leaves its result. Cache
+// storage is shared between workers, unlike globals.
+const disconnectCacheName = "19-abort/disconnect";
+
+// The server side of the disconnect test: waits for the client to go away,
+// then records the signal's abort reason.
+async function awaitDisconnect(request, resultUrl) {
+  for (let i = 0; i < 100 && !request.signal.aborted; i++) {
+    await sleep(50);
+  }
+  const result = request.signal.aborted
+    ? request.signal.reason.name
+    : "not aborted";
+  const cache = await caches.open(disconnectCacheName);
+  await cache.put(resultUrl, new Response(result));
+  return new Response(result);
+}
+
+async function testDisconnect(url) {
+  await promise_test(async () => {
+    const id = `${Date.now()}-${Math.random()}`;
+    const resultUrl = `${url.origin}/19-abort/disconnect/result/${id}`;
+
+    const controller = new AbortController();
+    const pending = fetch(`${url.origin}/19-abort/disconnect?id=${id}`, {
+      signal: controller.signal,
+    }).catch(() => {});
+    await sleep(200);
+    controller.abort();
+    await pending;
+
+    const cache = await caches.open(disconnectCacheName);
+    let result;
+    for (let i = 0; i < 100 && result === undefined; i++) {
+      result = await cache.match(resultUrl);
+      if (result === undefined) {
+        await sleep(50);
+      }
+    }
+    assert_true(result !== undefined, "the request finished after disconnect");
+    await cache.delete(resultUrl);
+    assert_equals(
+      await result.text(),
+      "AbortError",
+      "signal is aborted with an AbortError"
+    );
+  }, "incoming requests have a signal that is aborted on disconnect");
+
+  return new Response("All tests passed!", {
+    headers: { "content-type": "text/plain" },
+  });
+}
+
+async function handleRequest(request) {
   try {
+    const url = new URL(request.url);
+    if (url.pathname === "/19-abort/disconnect") {
+      const id = url.searchParams.get("id");
+      return id === null
+        ? await testDisconnect(url)
+        : await awaitDisconnect(
+            request,
+            `${url.origin}/19-abort/disconnect/result/${id}`
+          );
+    }
+
+    test((t) => {
+      const signal = request.signal;
+      assert_true(
+        signal instanceof AbortSignal,
+        "incoming request has an AbortSignal"
+      );
+      assert_false(signal.aborted, "signal of a live request is not aborted");
+      assert_equals(
+        request.signal,
+        signal,
+        "request.signal returns the same signal every time"
+      );
+    }, "incoming requests have a signal that is not aborted while live");
+
     test((t) => {
       const c = new AbortController(),
         s = c.signal;
@@ -0,0 +1,94 @@
+import { assert_equals, assert_not_equals, promise_test } from "../test-utils";
+
+// These tests need the server to run with --http-cache-mb. They request
+// responses from this same file through the server, and tell cache hits
+// from misses by the body, which is different on every call into JS.
+
+let nextBody = 0;
+
+function originResponse(kind) {
+  const body = `${Date.now()}-${Math.random()}-${++nextBody}`;
+  const headers = new Headers({ "Cache-Control": "max-age=60" });
+  switch (kind) {
+    case "fresh":
+      break;
+    case "vary":
+      headers.set("Vary", "X-Variant");
+      break;
+    case "no-store":
+      headers.set("Cache-Control", "no-store, max-age=60");
+      break;
+    case "set-cookie":
+      headers.set("Set-Cookie", "session=abc");
+      break;
+    case "cookie":
+      headers.set("Cache-Control", "s-maxage=60");
+      break;
+    default:
+      return new Response(`Unknown origin kind ${kind}`, { status: 404 });
+  }
+  return new Response(body, { headers });
+}
+
+async function handleRequest(request) {
+  const url = new URL(request.url);
+  const originPrefix = "/20-http-cache/origin/";
+  if (url.pathname.startsWith(originPrefix)) {
+    return originResponse(url.pathname.slice(originPrefix.length));
+  }
+
+  try {
+    // Keeps runs against a long-lived server from seeing each other's
+    // entries.
+    const run = `${Date.now()}-${Math.random()}`;
+    const get = async (kind, headers) => {
+      const response = await fetch(
+        `${url.origin}${originPrefix}${kind}?run=${run}`,
+        { headers }
+      );
+      return await response.text();
+    };
+
+    await promise_test(async () => {
+      const first = await get("fresh");
+      const second = await get("fresh");
+      assert_equals(second, first, "second request is served from the cache");
+    }, "Fresh responses are served from the cache");
+
+    await promise_test(async () => {
+      const a = await get("vary", { "X-Variant": "a" });
+      const b = await get("vary", { "X-Variant": "b" });
+      assert_not_equals(b, a, "a different variant is not a hit");
+      const a2 = await get("vary", { "X-Variant": "a" });
+      assert_equals(a2, a, "the same variant is a hit");
+    }, "Vary headers must match for a cache hit");
+
+    await promise_test(async () => {
+      const first = await get("no-store");
+      const second = await get("no-store");
+      assert_not_equals(second, first, "no-store responses are not stored");
+    }, "no-store responses are not cached");
+
+    await promise_test(async () => {
+      const first = await get("set-cookie");
+      const second = await get("set-cookie");
+      assert_not_equals(second, first, "responses setting cookies are not stored");
+    }, "Responses with Set-Cookie bypass the cache");
+
+    await promise_test(async () => {
+      const first = await get("cookie", { Cookie: "session=abc" });
+      const second = await get("cookie", { Cookie: "session=abc" });
+      assert_not_equals(
+        second,
+        first,
+        "responses to requests with cookies are not stored"
+      );
+    }, "Responses to requests with cookies are not cached, even with s-maxage");
+
+    return new Response("All tests passed!");
+  } catch (e) {
+    return new Response(e.toString(), { status: 500 });
+  }
+}
+
+export { handleRequest };
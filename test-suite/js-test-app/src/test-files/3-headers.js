@@ -9,6 +9,18 @@ async function handleRequest(request) {
     "X-Custom-Header": "CustomValue",
   });
 
+  if (path.includes("/incoming")) {
+    // Headers of incoming requests are readable and can be modified
+    const host = request.headers.get("Host");
+    if (!host || !request.headers.has("host")) {
+      return new Response("Missing host header", { status: 500 });
+    }
+    request.headers.set("X-Added-Header", "AddedValue");
+    if (request.headers.get("x-added-header") !== "AddedValue") {
+      return new Response("Failed to set header", { status: 500 });
+    }
+    return new Response("Incoming headers ok", { headers });
+  }
   if (path.includes("/append")) {
     // Append a new header
     headers.append("X-Appended-Header", "AppendedValue");
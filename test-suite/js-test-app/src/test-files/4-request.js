@@ -1,4 +1,22 @@
 async function handleRequest(request) {
+  if (request.url.includes("/incoming")) {
+    // Incoming requests are built natively, check they look like any other
+    const url = new URL(request.url);
+    if (request.method !== "GET") {
+      return new Response(`Unexpected method ${request.method}`, { status: 500 });
+    }
+    if (url.protocol !== "http:" || !url.pathname.endsWith("/incoming")) {
+      return new Response(`Unexpected URL ${request.url}`, { status: 500 });
+    }
+    if (!(request instanceof Request)) {
+      return new Response("Not a Request", { status: 500 });
+    }
+    if (request.body !== null || (await request.text()) !== "") {
+      return new Response("GET request has a body", { status: 500 });
+    }
+    return new Response("Incoming request ok");
+  }
+
   // Clone the request to ensure it's a new, mutable Request object
   let newRequest;
   try {
@@ -1,4 +1,37 @@
+// Returned for every request to /static
+const staticResponse = Response.static("static body", {
+  status: 200,
+  headers: { "X-Static-Header": "Static" },
+});
+
 async function handleRequest(request) {
+  if (request.url.includes("/static")) {
+    if (staticResponse.headers.get("X-Static-Header") !== "Static") {
+      return new Response("Static response lost its headers", { status: 500 });
+    }
+    for (const change of [
+      () => staticResponse.headers.set("X-Static-Header", "Changed"),
+      () =>
+        Headers.prototype.append.call(
+          staticResponse.headers,
+          "X-Other-Header",
+          "Changed"
+        ),
+    ]) {
+      try {
+        change();
+        return new Response("Static response headers can be changed", {
+          status: 500,
+        });
+      } catch (e) {
+        if (!(e instanceof TypeError)) {
+          return new Response(`Unexpected error: ${e}`, { status: 500 });
+        }
+      }
+    }
+    return staticResponse;
+  }
+
   const testUrl = "https://example.com";
   const testData = { key: "value" };
   const testHeaders = new Headers({ "X-Custom-Header": "Test" });
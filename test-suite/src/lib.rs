@@ -1,4 +1,4 @@
-use std::time::Duration;
+use std::{collections::HashMap, time::Duration};
 
 use anyhow::{bail, Result};
 use futures::{stream::FuturesUnordered, StreamExt};
@@ -13,6 +13,11 @@ pub struct TestCase {
     pub expected_output: String,
     pub expected_response_status: u16,
 
+    // Headers the response must have, with their values. Other headers
+    // are ignored.
+    #[serde(default)]
+    pub expected_headers: HashMap<String, String>,
+
     // Timeout in seconds, will be ignored if zero
     pub timeout: Option<f64>,
 
@@ -224,6 +229,7 @@ async fn run_test_once(
 
     let response = request.send().await?;
     let response_status = response.status();
+    let response_headers = response.headers().clone();
     let response_body = response.text().await?;
 
     if response_body != test_case.expected_output {
@@ -237,5 +243,12 @@ async fn run_test_once(
         bail!("Response status {response_status} doesn't match expected status {expected_response_status}");
     }
 
+    for (name, expected_value) in &test_case.expected_headers {
+        let value = response_headers.get(name).and_then(|v| v.to_str().ok());
+        if value != Some(expected_value.as_str()) {
+            bail!("Response header '{name}' is {value:?}, expected '{expected_value}'");
+        }
+    }
+
     anyhow::Ok(())
 }